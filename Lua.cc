@@ -1,4 +1,22 @@
 #include <Lua.hh>
+#include <LuaAllocator.hh>
+#include <LuaProfiler.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 extern "C" {
 #include <lualib.h>
@@ -7,12 +25,66 @@ extern "C" {
 
 using namespace util;
 
-int Lua::call(lua_State *vm) {
-    auto function = (std::function<int(Lua&)> *)
-        lua_touserdata(vm, lua_upvalueindex(1));
-    auto l = Lua(vm);
-    return (*function)(l);
+/*
+ * Lua version backend: everything that differs between the 5.1 (and
+ * LuaJIT) API and the 5.2+ API is funnelled through these helpers.
+ */
+#if LUA_VERSION_NUM >= 502
+static void global_table(lua_State *vm) {
+    lua_pushglobaltable(vm);
+}
+#else
+static void global_table(lua_State *vm) {
+    lua_pushvalue(vm, LUA_GLOBALSINDEX);
+}
+#endif
+
+#if LUA_VERSION_NUM >= 502
+static int load_chunk(lua_State *vm, lua_Reader reader, void *data,
+    const char *chunkname) {
+    return lua_load(vm, reader, data, chunkname, nullptr);
+}
+#else
+static int load_chunk(lua_State *vm, lua_Reader reader, void *data,
+    const char *chunkname) {
+    return lua_load(vm, reader, data, chunkname);
+}
+#endif
+
+#if LUA_VERSION_NUM >= 502
+static size_t raw_length(lua_State *vm, const int i) {
+    return lua_rawlen(vm, i);
+}
+#else
+static size_t raw_length(lua_State *vm, const int i) {
+    return lua_objlen(vm, i);
+}
+#endif
+
+#if LUA_VERSION_NUM >= 503
+static int dump(lua_State *vm, lua_Writer writer, void *data) {
+    return lua_dump(vm, writer, data, 0);
 }
+#else
+static int dump(lua_State *vm, lua_Writer writer, void *data) {
+    return lua_dump(vm, writer, data);
+}
+#endif
+
+#if LUA_VERSION_NUM >= 503
+static bool integer_at(lua_State *vm, const int i, lua_Integer *n) {
+    int isnum;
+    *n = lua_tointegerx(vm, i, &isnum);
+    return isnum;
+}
+#else
+static bool integer_at(lua_State *vm, const int i, lua_Integer *n) {
+    if (!lua_isnumber(vm, i))
+        return false;
+    *n = lua_tointeger(vm, i);
+    return true;
+}
+#endif
 
 Lua::Lua(lua_State *vm):
     del(false),
@@ -26,33 +98,504 @@ Lua::Lua():
     luaL_openlibs(vm);
 }
 
+static int panic(lua_State *vm) {
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+        lua_tostring(vm, -1));
+    return 0;
+}
+
+static lua_State * newstate(lua_Alloc allocator, void *data) {
+    auto vm = lua_newstate(allocator, data);
+    if (!vm)
+        throw std::bad_alloc();
+    lua_atpanic(vm, panic);
+    return vm;
+}
+
+Lua::Lua(lua_Alloc allocator, void *data):
+    del(true),
+    vm(newstate(allocator, data))
+{
+    luaL_openlibs(vm);
+}
+
+Lua::Lua(LuaAllocator& allocator):
+    Lua(LuaAllocator::allocate, &allocator)
+{}
+
 Lua::~Lua() {
-    for (auto lambda : lambdas)
-        delete lambda;
     if (del)
         lua_close(vm);
 }
 
-void Lua::lambda(std::function<int(Lua&)> *function, const std::string& name) {
-    lambdas.push_back(function);
-    userdata(function);
-    closure(Lua::call);
+lua_State * Lua::state() const {
+    return vm;
+}
+
+namespace {
+
+struct BindingRecord {
+    lua_CFunction function;
+    const char *name;
+    std::atomic<bool> *sample;
+    unsigned long calls;
+    uint64_t total_ns;
+    uint64_t histogram[32];
+};
+
+std::atomic<bool> instrumentation(false);
+
+}
+
+static const char binding_stats_key = 0;
+
+static unsigned latency_bucket(uint64_t ns) {
+    unsigned bucket = 0;
+    while (ns > 1 && bucket < 31) {
+        ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static int dispatch(lua_State *vm) {
+    auto record = (BindingRecord *)lua_touserdata(vm, lua_upvalueindex(2));
+    bool timed = instrumentation.load(std::memory_order_relaxed);
+    std::chrono::steady_clock::time_point started;
+    if (timed)
+        started = std::chrono::steady_clock::now();
+    int results = record->function(vm);
+    if (timed) {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started).count();
+        record->calls++;
+        record->total_ns += ns;
+        record->histogram[latency_bucket(ns)]++;
+    }
+    // Profiler hooks can't fire inside C functions: a sample requested
+    // while the binding ran is taken here, with the binding as leaf.
+    if (record->sample->load(std::memory_order_relaxed))
+        LuaProfiler::binding(vm, record->name);
+    return results;
+}
+
+/* Pushes the per-state table of binding records, keyed by name. */
+static void binding_stats(lua_State *vm) {
+    lua_pushlightuserdata(vm, const_cast<char *>(&binding_stats_key));
+    lua_rawget(vm, LUA_REGISTRYINDEX);
+    if (lua_istable(vm, -1))
+        return;
+    lua_pop(vm, 1);
+    lua_newtable(vm);
+    lua_pushlightuserdata(vm, const_cast<char *>(&binding_stats_key));
+    lua_pushvalue(vm, -2);
+    lua_rawset(vm, LUA_REGISTRYINDEX);
+}
+
+void Lua::bind(lua_CFunction function, const void *data, const size_t size,
+    const std::string& name) {
+    // Methods are recorded as Class.method: the class table carries its
+    // metatable, and the metatable the class name.
+    std::string qualified = name;
+    if (lua_istable(vm, -1)) {
+        lua_getfield(vm, -1, "mtab");
+        if (lua_istable(vm, -1)) {
+            lua_getfield(vm, -1, "__name");
+            if (lua_type(vm, -1) == LUA_TSTRING)
+                qualified = std::string(lua_tostring(vm, -1)) + "." + name;
+            pop();
+        }
+        pop();
+    }
+
+    memcpy(lua_newuserdata(vm, size), data, size);
+    // The qualified name is kept right after the record.
+    auto record = (BindingRecord *)lua_newuserdata(vm,
+        sizeof(BindingRecord) + qualified.size() + 1);
+    memset(record, 0, sizeof(BindingRecord));
+    record->function = function;
+    record->name = (const char *)memcpy(record + 1, qualified.c_str(),
+        qualified.size() + 1);
+    record->sample = LuaProfiler::pending(vm);
+    binding_stats(vm);
+    string(qualified);
+    copy(-3);
+    lua_rawset(vm, -3);
+    pop();
+    closure(dispatch, 2);
     save(name);
 }
 
+void Lua::instrument(const bool enabled) {
+    instrumentation.store(enabled, std::memory_order_relaxed);
+}
+
+bool Lua::instrumented() {
+    return instrumentation.load(std::memory_order_relaxed);
+}
+
+std::vector<Lua::BindingStats> Lua::stats(const bool reset) {
+    std::vector<BindingStats> result;
+    binding_stats(vm);
+    lua_pushnil(vm);
+    while (lua_next(vm, -2)) {
+        auto record = (BindingRecord *)lua_touserdata(vm, -1);
+        if (record->calls) {
+            BindingStats entry;
+            entry.name = lua_tostring(vm, -2);
+            entry.calls = record->calls;
+            entry.total_ns = record->total_ns;
+            memcpy(entry.histogram, record->histogram,
+                sizeof(entry.histogram));
+            result.push_back(entry);
+        }
+        if (reset) {
+            record->calls = 0;
+            record->total_ns = 0;
+            memset(record->histogram, 0, sizeof(record->histogram));
+        }
+        pop();
+    }
+    pop();
+    return result;
+}
+
+static const char ffi_binder[] =
+    "local name, ctype, pointer = ...\n"
+    "local ok, ffi = pcall(require, 'ffi')\n"
+    "if not ok then return false end\n"
+    "_G[name] = ffi.cast(ctype, pointer)\n"
+    "return true\n";
+
+bool Lua::ffi(const std::string& name, const char *result,
+    const char * const *args, const void *function) {
+    std::string ctype = std::string(result) + " (*)(";
+    if (!*args)
+        ctype += "void";
+    for (auto arg = args; *arg; arg++) {
+        if (arg != args)
+            ctype += ", ";
+        ctype += *arg;
+    }
+    ctype += ")";
+
+    if (luaL_loadbuffer(vm, ffi_binder, sizeof(ffi_binder) - 1, "=ffi"))
+        lua_error(vm);
+    string(name);
+    string(ctype);
+    userdata(function);
+    lua_call(vm, 3, 1);
+    bool bound = boolean();
+    pop();
+    return bound;
+}
+
+namespace {
+
+struct Protected {
+    void (*function)(Lua&, void *);
+    void *data;
+};
+
+}
+
+static int protected_call(lua_State *vm) {
+    auto call = (Protected *)lua_touserdata(vm, -1);
+    lua_pop(vm, 1);
+    Lua l(vm);
+    call->function(l, call->data);
+    return 0;
+}
+
+void Lua::protect(void (*function)(Lua&, void *), void *data, const int n) {
+    Protected call = { function, data };
+    lua_pushcfunction(vm, protected_call);
+    lua_insert(vm, -n - 1);
+    userdata(&call);
+    if (lua_pcall(vm, n + 1, 0, 0)) {
+        size_t length;
+        auto message = lua_tolstring(vm, -1, &length);
+        std::string error = message ? std::string(message, length)
+            : std::string("(error object is not a string)");
+        pop();
+        throw std::runtime_error(error);
+    }
+}
+
+std::vector<Lua::BatchError> Lua::run_batch(const int reference,
+    lua_CFunction step, void *context, size_t *index, const size_t count) {
+    std::vector<BatchError> errors;
+    deref(reference);
+    lua_pushcclosure(vm, step, 1);
+    int closure = lua_gettop(vm);
+
+    for (*index = 0; *index < count; (*index)++) {
+        lua_pushvalue(vm, closure);
+        lua_pushlightuserdata(vm, context);
+        if (lua_pcall(vm, 1, 0, 0)) {
+            size_t length;
+            auto message = lua_tolstring(vm, -1, &length);
+            BatchError error = { *index, message ? std::string(message, length)
+                : std::string("(error object is not a string)") };
+            errors.push_back(error);
+            pop();
+        }
+    }
+
+    lua_settop(vm, closure - 1);
+    return errors;
+}
+
+void * Lua::upvalue(const int i) {
+    return lua_touserdata(vm, lua_upvalueindex(i));
+}
+
+Lua::Name Lua::intern(const std::string& name) {
+    string(name);
+    Name interned = { luaL_ref(vm, LUA_REGISTRYINDEX) };
+    return interned;
+}
+
+int Lua::ref() {
+    return luaL_ref(vm, LUA_REGISTRYINDEX);
+}
+
+void Lua::deref(const int reference) {
+    lua_rawgeti(vm, LUA_REGISTRYINDEX, reference);
+}
+
+void Lua::unref(const int reference) {
+    luaL_unref(vm, LUA_REGISTRYINDEX, reference);
+}
+
+void Lua::globals() {
+    global_table(vm);
+}
+
+void Lua::global(const std::string& name) {
+    lua_getglobal(vm, name.c_str());
+}
+
+LuaChunkCache::LuaChunkCache(const std::string& directory):
+    directory(directory),
+    hit(0),
+    miss(0)
+{
+    mkdir(directory.c_str(), 0755);
+}
+
+unsigned long LuaChunkCache::hits() const {
+    return hit;
+}
+
+unsigned long LuaChunkCache::misses() const {
+    return miss;
+}
+
+static uint64_t fnv1a(const char *data, const size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+namespace {
+
+struct ChunkHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t path;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint64_t hash;
+};
+
+const char chunk_magic[8] = { 'L', 'u', 'a', 'C', 'x', 'x', 'C', '1' };
+
+/*
+ * Read-only private mapping of a whole file. Scripts are handed to the
+ * parser straight from the page cache, shared by every state loading
+ * them, instead of being copied through stdio buffers.
+ */
+class Mapping {
+public:
+    const char *data;
+    size_t size;
+    bool valid;
+    struct stat st;
+
+    Mapping(const std::string& name):
+        data(nullptr),
+        size(0),
+        valid(false)
+    {
+        int fd = open(name.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+            size = st.st_size;
+            if (size) {
+                void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    data = (const char *)p;
+                    valid = true;
+                }
+            } else {
+                valid = true;
+            }
+        }
+        close(fd);
+    }
+
+    ~Mapping() {
+        if (data)
+            munmap(const_cast<char *>(data), size);
+    }
+};
+
+struct Chunk {
+    const char *data;
+    size_t size;
+};
+
+const char * read_chunk(lua_State *, void *data, size_t *size) {
+    auto chunk = (Chunk *)data;
+    *size = chunk->size;
+    chunk->size = 0;
+    return *size ? chunk->data : nullptr;
+}
+
+}
+
+static int load_buffer(lua_State *vm, const char *data, const size_t size,
+    const char *chunkname) {
+    Chunk chunk = { data, size };
+    return load_chunk(vm, read_chunk, &chunk, chunkname);
+}
+
+static int append(lua_State *, const void *p, size_t size, void *data) {
+    static_cast<std::string *>(data)->append((const char *)p, size);
+    return 0;
+}
+
+/*
+ * Source text without a leading "#!" line; the newline is kept so line
+ * numbers stay the same, as luaL_loadfile does.
+ */
+static size_t skip_comment(const char *data, const size_t size) {
+    if (!size || data[0] != '#')
+        return 0;
+    auto end = (const char *)memchr(data, '\n', size);
+    return end ? end - data : size;
+}
+
 void Lua::file(const std::string& name) {
-    luaL_dofile(vm, name.c_str()) && lua_error(vm);
+    Mapping source(name);
+    if (!source.valid) {
+        luaL_dofile(vm, name.c_str()) && lua_error(vm);
+        return;
+    }
+    auto chunkname = "@" + name;
+    auto offset = skip_comment(source.data, source.size);
+    (load_buffer(vm, source.data + offset, source.size - offset,
+        chunkname.c_str()) || lua_pcall(vm, 0, LUA_MULTRET, 0))
+        && lua_error(vm);
+}
+
+void Lua::file(const std::string& name, LuaChunkCache& cache) {
+    Mapping source(name);
+    if (!source.valid)
+        luaL_error(vm, "cannot open %s", name.c_str());
+
+    ChunkHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, chunk_magic, sizeof(header.magic));
+    header.version = LUA_VERSION_NUM;
+    header.path = name.size();
+    header.size = source.st.st_size;
+    header.mtime = source.st.st_mtim.tv_sec;
+    header.mtime_nsec = source.st.st_mtim.tv_nsec;
+    header.hash = fnv1a(source.data, source.size);
+
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx",
+        (unsigned long long)fnv1a(name.data(), name.size()));
+    auto path = cache.directory + "/" + key + ".luac";
+    auto chunkname = "@" + name;
+
+    bool loaded = false;
+    {
+        Mapping chunk(path);
+        auto offset = sizeof(header) + name.size();
+        if (chunk.valid && chunk.size >= offset
+            && !memcmp(chunk.data, &header, sizeof(header))
+            && !memcmp(chunk.data + sizeof(header), name.data(), name.size())) {
+            if (!load_buffer(vm, chunk.data + offset, chunk.size - offset,
+                chunkname.c_str()))
+                loaded = true;
+            else
+                pop();
+        }
+    }
+
+    if (loaded) {
+        cache.hit++;
+    } else {
+        cache.miss++;
+        auto offset = skip_comment(source.data, source.size);
+        if (load_buffer(vm, source.data + offset, source.size - offset,
+            chunkname.c_str()))
+            lua_error(vm);
+
+        std::string chunk((const char *)&header, sizeof(header));
+        chunk.append(name);
+        auto temporary = path + "." + std::to_string(getpid()) + "."
+            + std::to_string((uintptr_t)vm);
+        FILE *f;
+        if (!dump(vm, append, &chunk) && (f = fopen(temporary.c_str(), "wb"))) {
+            bool written = fwrite(chunk.data(), 1, chunk.size(), f)
+                == chunk.size();
+            if (fclose(f) || !written || rename(temporary.c_str(), path.c_str()))
+                ::remove(temporary.c_str());
+        }
+    }
+
+    lua_pcall(vm, 0, LUA_MULTRET, 0) && lua_error(vm);
+}
+
+void Lua::buffer(const char *data, const size_t size, const std::string& name) {
+    (load_buffer(vm, data, size, name.c_str())
+        || lua_pcall(vm, 0, LUA_MULTRET, 0)) && lua_error(vm);
 }
 
 void Lua::load(const std::string& name, int i) {
+    if (lua_gettop(vm) - (i>0?i:-i) < 0 || !lua_istable(vm, i)) {
+        if (-1 != i)
+            luaL_error(vm, "Invalid load operation (out of stack)!");
+        lua_getglobal(vm, name.c_str());
+        return;
+    }
+    lua_getfield(vm, i, name.c_str());
+}
+
+void Lua::load(const Name& name, const int i) {
     int t = i;
+    bool global = false;
     if (lua_gettop(vm) - (i>0?i:-i) < 0 || !lua_istable(vm, i)) {
-        if (-1 == i) 
-            t = LUA_GLOBALSINDEX;
-        else
+        if (-1 != i)
             luaL_error(vm, "Invalid load operation (out of stack)!");
+        global_table(vm);
+        global = true;
     }
-    lua_getfield(vm, t, name.c_str());
+    if (t < 0 && t > LUA_REGISTRYINDEX)
+        t--;
+    lua_rawgeti(vm, LUA_REGISTRYINDEX, name.ref);
+    lua_gettable(vm, t);
+    if (global)
+        lua_remove(vm, -2);
 }
 
 void Lua::pop(const int i) {
@@ -71,6 +614,26 @@ void Lua::table() {
     lua_newtable(vm);
 }
 
+void Lua::table(const int narr, const int nrec) {
+    lua_createtable(vm, narr, nrec);
+}
+
+size_t Lua::length(const int i) {
+    return raw_length(vm, i);
+}
+
+int Lua::absolute(const int i) {
+    if (i > 0 || i <= LUA_REGISTRYINDEX)
+        return i;
+    return lua_gettop(vm) + i + 1;
+}
+
+void Lua::check_table(const int i) {
+    if (!lua_istable(vm, i))
+        luaL_error(vm, "Invalid argument #%d (table expected, got %s)!", i,
+            luaL_typename(vm, i));
+}
+
 void Lua::metatable(const int i) {
     if (lua_gettop(vm) - (i>0?i:-i) < 0
         || !lua_istable(vm, i) && !lua_isuserdata(vm, i))
@@ -91,14 +654,32 @@ void Lua::copy(const int i) {
 }
 
 void Lua::save(const std::string& name, const int i) {
+    if (lua_gettop(vm) - (i>0?i:-i) < 0 || !lua_istable(vm, i)) {
+        if (-2 != i)
+            luaL_error(vm, "Invalid save operation (out of stack)!");
+        lua_setglobal(vm, name.c_str());
+        return;
+    }
+    lua_setfield(vm, i, name.c_str());
+}
+
+void Lua::save(const Name& name, const int i) {
     int t = i;
+    bool global = false;
     if (lua_gettop(vm) - (i>0?i:-i) < 0 || !lua_istable(vm, i)) {
-        if (-2 == i)
-            t = LUA_GLOBALSINDEX;
-        else
+        if (-2 != i)
             luaL_error(vm, "Invalid save operation (out of stack)!");
+        global_table(vm);
+        lua_insert(vm, -2);
+        global = true;
     }
-    lua_setfield(vm, t, name.c_str());
+    if (t < 0 && t > LUA_REGISTRYINDEX)
+        t--;
+    lua_rawgeti(vm, LUA_REGISTRYINDEX, name.ref);
+    lua_insert(vm, -2);
+    lua_settable(vm, t);
+    if (global)
+        pop();
 }
 
 bool Lua::is_nil(const int i) {
@@ -107,38 +688,820 @@ bool Lua::is_nil(const int i) {
     return lua_isnil(vm, i);
 }
 
+namespace {
+
+/*
+ * Serialized values: a tag byte, then varints (LEB128) for lengths and
+ * zigzagged integers. Strings get an index in order of first appearance
+ * and later copies are written as a reference. A table is its array
+ * length, a fixed 4-byte hash count (patched once the pairs are written),
+ * the array values and then the key/value pairs. Numbers are native
+ * doubles, so snapshots are not portable across byte orders.
+ */
+enum SerialTag {
+    SerialNil,
+    SerialFalse,
+    SerialTrue,
+    SerialNumber,
+    SerialInteger,
+    SerialString,
+    SerialStringRef,
+    SerialTable
+};
+
+const int serial_depth = 200;
+
+struct Encoder {
+    lua_State *vm;
+    char *buffer;
+    size_t size;
+    size_t position;
+    // Keyed by address: every string stays alive (and unique) while
+    // the value holding it is on the stack.
+    std::unordered_map<const void *, uint64_t> strings;
+
+    void bytes(const void *data, const size_t n) {
+        if (position < size)
+            memcpy(buffer + position, data, std::min(n, size - position));
+        position += n;
+    }
+
+    void byte(const unsigned char c) {
+        if (position < size)
+            buffer[position] = c;
+        position++;
+    }
+
+    void varint(uint64_t n) {
+        for (; n >= 0x80; n >>= 7)
+            byte((n & 0x7f) | 0x80);
+        byte(n);
+    }
+
+    void integer(const int64_t n) {
+        byte(SerialInteger);
+        varint(((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+    }
+
+    void number(const int i) {
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(vm, i)) {
+            integer(lua_tointeger(vm, i));
+            return;
+        }
+#endif
+        double n = lua_tonumber(vm, i);
+#if LUA_VERSION_NUM < 503
+        if (n == std::floor(n) && std::fabs(n) < 9007199254740992.0
+            && !(n == 0 && std::signbit(n))) {
+            integer((int64_t)n);
+            return;
+        }
+#endif
+        byte(SerialNumber);
+        bytes(&n, sizeof(n));
+    }
+
+    void string(const int i) {
+        size_t length;
+        const char *s = lua_tolstring(vm, i, &length);
+        auto found = strings.emplace(s, strings.size());
+        if (!found.second) {
+            byte(SerialStringRef);
+            varint(found.first->second);
+            return;
+        }
+        byte(SerialString);
+        varint(length);
+        bytes(s, length);
+    }
+
+    bool array_key(const int i, const size_t narr) {
+        if (lua_type(vm, i) != LUA_TNUMBER)
+            return false;
+        lua_Number k = lua_tonumber(vm, i);
+        return k >= 1 && k <= narr && k == (size_t)k;
+    }
+
+    void table(const int t, const int depth) {
+        if (depth > serial_depth)
+            throw std::runtime_error("Cannot serialize a cyclic or too deeply "
+                "nested table!");
+        if (!lua_checkstack(vm, 3))
+            throw std::runtime_error("Cannot serialize (out of stack)!");
+        size_t narr = raw_length(vm, t);
+        byte(SerialTable);
+        varint(narr);
+        size_t slot = position;
+        position += 4;
+        for (size_t k = 1; k <= narr; k++) {
+            lua_rawgeti(vm, t, k);
+            value(-1, depth);
+            lua_pop(vm, 1);
+        }
+        uint32_t nrec = 0;
+        lua_pushnil(vm);
+        while (lua_next(vm, t)) {
+            if (!array_key(-2, narr)) {
+                value(-2, depth);
+                value(-1, depth);
+                nrec++;
+            }
+            lua_pop(vm, 1);
+        }
+        for (int k = 0; k < 4 && slot + k < size; k++)
+            buffer[slot + k] = nrec >> (8 * k);
+    }
+
+    void value(const int i, const int depth) {
+        switch (lua_type(vm, i)) {
+        case LUA_TNIL:
+            byte(SerialNil);
+            break;
+        case LUA_TBOOLEAN:
+            byte(lua_toboolean(vm, i) ? SerialTrue : SerialFalse);
+            break;
+        case LUA_TNUMBER:
+            number(i);
+            break;
+        case LUA_TSTRING:
+            string(i);
+            break;
+        case LUA_TTABLE:
+            table(i > 0 ? i : lua_gettop(vm) + i + 1, depth + 1);
+            break;
+        default:
+            throw std::runtime_error(std::string("Cannot serialize a ")
+                + lua_typename(vm, lua_type(vm, i)) + "!");
+        }
+    }
+};
+
+struct Decoder {
+    lua_State *vm;
+    const char *data;
+    size_t size;
+    size_t position;
+    std::vector<std::pair<const char *, size_t>> strings;
+
+    static void malformed() {
+        throw std::runtime_error("Cannot deserialize (malformed data)!");
+    }
+
+    const char * bytes(const size_t n) {
+        if (n > size - position)
+            malformed();
+        const char *p = data + position;
+        position += n;
+        return p;
+    }
+
+    unsigned char byte() {
+        return *bytes(1);
+    }
+
+    uint64_t varint() {
+        uint64_t n = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            unsigned char c = byte();
+            n |= (uint64_t)(c & 0x7f) << shift;
+            if (!(c & 0x80))
+                return n;
+        }
+        malformed();
+        return 0;
+    }
+
+    void table(const int depth) {
+        if (depth > serial_depth)
+            malformed();
+        if (!lua_checkstack(vm, 3))
+            throw std::runtime_error("Cannot deserialize (out of stack)!");
+        uint64_t narr = varint();
+        const unsigned char *slot = (const unsigned char *)bytes(4);
+        uint32_t nrec = slot[0] | slot[1] << 8 | slot[2] << 16
+            | (uint32_t)slot[3] << 24;
+        // Every value takes at least a byte: bounds the presizing below.
+        if (narr > size - position || nrec > (size - position) / 2)
+            malformed();
+        lua_createtable(vm, narr, nrec);
+        for (uint64_t k = 1; k <= narr; k++) {
+            value(depth);
+            lua_rawseti(vm, -2, k);
+        }
+        for (uint32_t k = 0; k < nrec; k++) {
+            value(depth);
+            if (lua_isnil(vm, -1) || (lua_type(vm, -1) == LUA_TNUMBER
+                && lua_tonumber(vm, -1) != lua_tonumber(vm, -1)))
+                malformed();
+            value(depth);
+            lua_rawset(vm, -3);
+        }
+    }
+
+    void value(const int depth) {
+        switch (byte()) {
+        case SerialNil:
+            lua_pushnil(vm);
+            break;
+        case SerialFalse:
+            lua_pushboolean(vm, 0);
+            break;
+        case SerialTrue:
+            lua_pushboolean(vm, 1);
+            break;
+        case SerialNumber: {
+            double n;
+            memcpy(&n, bytes(sizeof(n)), sizeof(n));
+            lua_pushnumber(vm, n);
+            break;
+        }
+        case SerialInteger: {
+            uint64_t z = varint();
+            int64_t n = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+#if LUA_VERSION_NUM >= 503
+            lua_pushinteger(vm, n);
+#else
+            lua_pushnumber(vm, n);
+#endif
+            break;
+        }
+        case SerialString: {
+            uint64_t length = varint();
+            const char *s = bytes(length);
+            strings.emplace_back(s, length);
+            lua_pushlstring(vm, s, length);
+            break;
+        }
+        case SerialStringRef: {
+            uint64_t index = varint();
+            if (index >= strings.size())
+                malformed();
+            lua_pushlstring(vm, strings[index].first, strings[index].second);
+            break;
+        }
+        case SerialTable:
+            table(depth + 1);
+            break;
+        default:
+            malformed();
+        }
+    }
+};
+
+}
+
+size_t Lua::serialize(const int i, char *buffer, const size_t size) {
+    if (lua_gettop(vm) - (i>0?i:-i) < 0)
+        throw std::runtime_error("Invalid serialize operation (out of stack)!");
+    int top = lua_gettop(vm);
+    Encoder encoder = { vm, buffer, size, 0, {} };
+    try {
+        encoder.value(absolute(i), 0);
+    } catch (...) {
+        lua_settop(vm, top);
+        throw;
+    }
+    return encoder.position;
+}
+
+std::string Lua::serialize(const int i) {
+    std::string result(256, '\0');
+    size_t size = serialize(i, &result[0], result.size());
+    result.resize(size);
+    if (size > 256)
+        serialize(i, &result[0], result.size());
+    return result;
+}
+
+void Lua::deserialize(const char *data, const size_t size) {
+    int top = lua_gettop(vm);
+    Decoder decoder = { vm, data, size, 0, {} };
+    try {
+        decoder.value(0);
+        if (decoder.position != size)
+            Decoder::malformed();
+    } catch (...) {
+        lua_settop(vm, top);
+        throw;
+    }
+}
+
+/*
+ * Key of the class set in every class metatable: the class keys its
+ * objects answer to, the class's own and its bases'. Only userdata with
+ * such a metatable hold a LuaClass pointer.
+ */
+static const char class_set_key = 0;
+
+/* Pushes the class set of the value at i, or nothing and false. */
+static bool class_set(lua_State *vm, const int i) {
+    if (lua_type(vm, i) != LUA_TUSERDATA || !lua_getmetatable(vm, i))
+        return false;
+    lua_pushlightuserdata(vm, const_cast<char *>(&class_set_key));
+    lua_rawget(vm, -2);
+    lua_remove(vm, -2);
+    if (lua_istable(vm, -1))
+        return true;
+    lua_pop(vm, 1);
+    return false;
+}
+
+static LuaClass * instance(lua_State *vm, const int i) {
+    if (!class_set(vm, i))
+        return nullptr;
+    lua_pop(vm, 1);
+    return *(LuaClass **)lua_touserdata(vm, i);
+}
+
+namespace {
+
+/*
+ * Header of every object userdata. The object pointer comes first, so
+ * instance() reads any of them; owned says a Handle follows.
+ */
+struct Wrapper {
+    LuaClass *object;
+    bool owned;
+};
+
+/* Userdata of an object pushed with its shared_ptr owner. */
+struct Handle {
+    Wrapper wrapper;
+    std::shared_ptr<LuaClass> owner;
+};
+
+}
+
+static Handle * handle(lua_State *vm, const int i) {
+    if (!instance(vm, i))
+        return nullptr;
+    auto wrapper = (Wrapper *)lua_touserdata(vm, i);
+    return wrapper->owned ? (Handle *)wrapper : nullptr;
+}
+
 static int collect(lua_State *vm) {
-    if (lua_gettop(vm) != 1 || !lua_isuserdata(vm, 1))
-        luaL_error(vm, "Invalid collect operation!");
-    LuaClass * object = (LuaClass *)lua_touserdata(vm, 1);
-    object->collect();
+    LuaClass * object = instance(vm, 1);
+    if (!object)
+        return 0;
+    auto owned = handle(vm, 1);
+    if (owned)
+        owned->~Handle();
+    else
+        object->collect();
     return 0;
 }
 
-void Lua::object(const LuaClass *object, const std::string& name) {
-    load(name);
-    table();
-    load("mtab", -2);
-    metatable();
-    remove(-2);
-    userdata(object);
-    table();
+static int equal(lua_State *vm) {
+    lua_pushboolean(vm, instance(vm, 1) == instance(vm, 2));
+    return 1;
+}
+
+static int tostring(lua_State *vm) {
+    lua_getmetatable(vm, 1);
+    lua_getfield(vm, -1, "__name");
+    lua_pushfstring(vm, "%s: %p", lua_tostring(vm, -1), instance(vm, 1));
+    return 1;
+}
+
+void Lua::class_metatable(const std::string& name, const void *key,
+    const void *parent) {
+    if (lua_gettop(vm) < 1 || !lua_istable(vm, -1))
+        luaL_error(vm, "Invalid class metatable operation (table expected)!");
+    luaL_newmetatable(vm, name.c_str());
+    lua_pushlightuserdata(vm, const_cast<char *>(&class_set_key));
+    lua_newtable(vm);
+    int set = lua_gettop(vm);
+    userdata(key);
+    lua_pushboolean(vm, 1);
+    lua_rawset(vm, set);
+    if (parent) {
+        userdata(parent);
+        lua_rawget(vm, LUA_REGISTRYINDEX);
+        if (lua_istable(vm, -1)) {
+            lua_pushlightuserdata(vm, const_cast<char *>(&class_set_key));
+            lua_rawget(vm, -2);
+        }
+        if (lua_istable(vm, -1)) {
+            lua_pushnil(vm);
+            while (lua_next(vm, -2)) {
+                lua_pushvalue(vm, -2);
+                lua_insert(vm, -2);
+                lua_rawset(vm, set);
+            }
+        }
+        lua_settop(vm, set);
+    }
+    lua_rawset(vm, -3);
+    copy(-2);
+    save("__index");
+    string(name);
+    save("__name");
     lua_pushcfunction(vm, collect);
     save("__gc");
-    metatable();
-    save("__self__");
-    const_cast<LuaClass *>(object)->reference();
+    lua_pushcfunction(vm, equal);
+    save("__eq");
+    lua_pushcfunction(vm, tostring);
+    save("__tostring");
+    userdata(key);
+    copy(-2);
+    lua_rawset(vm, LUA_REGISTRYINDEX);
+}
+
+namespace {
+
+struct FieldSlot {
+    const char *name;
+    size_t length;
+    LuaField field;
+};
+
+/*
+ * Perfect hash over the addresses of the interned field names: a key
+ * string from a script is the same object, so a lookup is one multiply,
+ * one shift and one pointer compare. Long strings are not interned on
+ * 5.2+ and fall back to comparing contents.
+ */
+struct FieldHash {
+    uint64_t multiplier;
+    unsigned shift;
+    size_t size;
+    FieldSlot slots[1];
+};
+
+static const size_t max_short_string = 40;
+
+}
+
+static size_t field_slot(const uint64_t multiplier, const unsigned shift,
+    const char *name) {
+    return (size_t)((((uint64_t)(uintptr_t)name) >> 3) * multiplier >> shift);
+}
+
+static const FieldSlot * find_field(const FieldHash *hash, const char *key,
+    const size_t length) {
+    auto slot = &hash->slots[field_slot(hash->multiplier, hash->shift, key)];
+    if (slot->name == key)
+        return slot;
+    if (length <= max_short_string)
+        return nullptr;
+    for (size_t i = 0; i < hash->size; i++) {
+        slot = &hash->slots[i];
+        if (slot->name && slot->length == length
+            && !memcmp(slot->name, key, length))
+            return slot;
+    }
+    return nullptr;
+}
+
+static int field_index(lua_State *vm) {
+    if (lua_type(vm, 2) == LUA_TSTRING) {
+        auto hash = (const FieldHash *)lua_touserdata(vm, lua_upvalueindex(1));
+        size_t length;
+        auto key = lua_tolstring(vm, 2, &length);
+        auto slot = find_field(hash, key, length);
+        if (slot) {
+            Lua l(vm);
+            return slot->field.get(l, l.object(1), slot->field.accessor);
+        }
+    }
+    lua_pushvalue(vm, 2);
+    lua_gettable(vm, lua_upvalueindex(2));
+    return 1;
+}
+
+static int field_newindex(lua_State *vm) {
+    auto hash = (const FieldHash *)lua_touserdata(vm, lua_upvalueindex(1));
+    size_t length;
+    auto key = lua_tolstring(vm, 2, &length);
+    auto slot = key ? find_field(hash, key, length) : nullptr;
+    if (!slot)
+        luaL_error(vm, "Invalid field %s!", key ? key : "?");
+    if (!slot->field.set)
+        luaL_error(vm, "Field %s is read-only!", key);
+    Lua l(vm);
+    slot->field.set(l, l.object(1), slot->field.accessor, 3);
+    return 0;
+}
+
+/*
+ * Rebuilds the perfect hash from the metatable's __fields table and
+ * installs the field __index/__newindex closures. Expects the class table
+ * at -2 and its metatable at -1.
+ */
+static void build_fields(lua_State *vm) {
+    std::vector<FieldSlot> fields;
+    lua_getfield(vm, -1, "__fields");
+    lua_pushnil(vm);
+    while (lua_next(vm, -2)) {
+        FieldSlot slot;
+        slot.name = lua_tolstring(vm, -2, &slot.length);
+        slot.field = *(const LuaField *)lua_touserdata(vm, -1);
+        fields.push_back(slot);
+        lua_pop(vm, 1);
+    }
+    lua_pop(vm, 1);
+
+    unsigned bits = 1;
+    while (((size_t)1 << bits) < 2 * fields.size())
+        bits++;
+
+    uint64_t multiplier = 0;
+    for (;; bits++) {
+        size_t size = (size_t)1 << bits;
+        std::vector<bool> used(size);
+        for (uint64_t seed = 0; seed < 64 && !multiplier; seed++) {
+            uint64_t candidate = 0x9E3779B97F4A7C15ull * (2 * seed + 1);
+            std::fill(used.begin(), used.end(), false);
+            bool collision = false;
+            for (auto& field : fields) {
+                auto i = field_slot(candidate, 64 - bits, field.name);
+                if (used[i]) {
+                    collision = true;
+                    break;
+                }
+                used[i] = true;
+            }
+            if (!collision)
+                multiplier = candidate;
+        }
+        if (multiplier)
+            break;
+    }
+
+    size_t size = (size_t)1 << bits;
+    auto hash = (FieldHash *)lua_newuserdata(vm,
+        sizeof(FieldHash) + (size - 1) * sizeof(FieldSlot));
+    hash->multiplier = multiplier;
+    hash->shift = 64 - bits;
+    hash->size = size;
+    memset(hash->slots, 0, size * sizeof(FieldSlot));
+    for (auto& field : fields)
+        hash->slots[field_slot(multiplier, hash->shift, field.name)] = field;
+
+    lua_pushvalue(vm, -1);
+    lua_pushvalue(vm, -4);
+    lua_pushcclosure(vm, field_index, 2);
+    lua_setfield(vm, -3, "__index");
+    lua_pushcclosure(vm, field_newindex, 1);
+    lua_setfield(vm, -2, "__newindex");
+}
+
+void Lua::field(const std::string& name, const LuaField& field) {
+    if (lua_gettop(vm) < 1 || !lua_istable(vm, -1))
+        luaL_error(vm, "Invalid field operation (class table expected)!");
+    lua_getfield(vm, -1, "mtab");
+    lua_getfield(vm, -1, "__fields");
+    if (is_nil()) {
+        pop();
+        table();
+        copy();
+        lua_setfield(vm, -3, "__fields");
+    }
+    *(LuaField *)lua_newuserdata(vm, sizeof(LuaField)) = field;
+    lua_setfield(vm, -2, name.c_str());
+    pop();
+    build_fields(vm);
+    pop();
+}
+
+void Lua::inherit_fields(const std::string& parent) {
+    global(parent);
+    lua_getfield(vm, -1, "mtab");
+    lua_getfield(vm, -1, "__fields");
+    lua_remove(vm, -2);
+    lua_remove(vm, -2);
+    if (is_nil()) {
+        pop();
+        return;
+    }
+
+    lua_getfield(vm, -2, "mtab");
+    table();
+    lua_pushnil(vm);
+    while (lua_next(vm, -4)) {
+        lua_pushvalue(vm, -2);
+        lua_insert(vm, -2);
+        lua_rawset(vm, -4);
+    }
+    lua_setfield(vm, -2, "__fields");
+    lua_remove(vm, -2);
+    build_fields(vm);
+    pop();
+}
+
+void Lua::flatten(const std::string& parent) {
+    int t = lua_gettop(vm);
+    global(parent);
+    while (lua_istable(vm, -1)) {
+        lua_pushnil(vm);
+        while (lua_next(vm, -2)) {
+            // The nearest definition wins; the class's own come later and
+            // simply overwrite.
+            bool skip = lua_type(vm, -2) == LUA_TSTRING
+                && !strcmp(lua_tostring(vm, -2), "mtab");
+            if (!skip) {
+                lua_pushvalue(vm, -2);
+                lua_rawget(vm, t);
+                skip = !lua_isnil(vm, -1);
+                pop();
+            }
+            if (!skip) {
+                lua_pushvalue(vm, -2);
+                lua_insert(vm, -2);
+                lua_rawset(vm, t);
+            } else {
+                pop();
+            }
+        }
+        if (!lua_getmetatable(vm, -1))
+            break;
+        lua_getfield(vm, -1, "__index");
+        lua_remove(vm, -2);
+        lua_remove(vm, -2);
+    }
+    lua_settop(vm, t);
+}
+
+namespace {
+
+struct ObjectCounters {
+    unsigned long hits;
+    unsigned long misses;
+};
+
+}
+
+static const char object_cache_key = 0;
+static const char object_counters_key = 0;
+
+static ObjectCounters * object_counters(lua_State *vm) {
+    lua_pushlightuserdata(vm, const_cast<char *>(&object_counters_key));
+    lua_rawget(vm, LUA_REGISTRYINDEX);
+    auto counters = (ObjectCounters *)lua_touserdata(vm, -1);
+    lua_pop(vm, 1);
+    if (counters)
+        return counters;
+    lua_pushlightuserdata(vm, const_cast<char *>(&object_counters_key));
+    counters = (ObjectCounters *)lua_newuserdata(vm, sizeof(ObjectCounters));
+    counters->hits = counters->misses = 0;
+    lua_rawset(vm, LUA_REGISTRYINDEX);
+    return counters;
+}
+
+/*
+ * Pushes the per-state cache of wrappers, keyed by object address. Values
+ * are weak, so the cache never keeps a wrapper (or its reference) alive.
+ */
+static void object_cache(lua_State *vm) {
+    lua_pushlightuserdata(vm, const_cast<char *>(&object_cache_key));
+    lua_rawget(vm, LUA_REGISTRYINDEX);
+    if (lua_istable(vm, -1))
+        return;
+    lua_pop(vm, 1);
+    lua_newtable(vm);
+    lua_createtable(vm, 0, 1);
+    lua_pushliteral(vm, "v");
+    lua_setfield(vm, -2, "__mode");
+    lua_setmetatable(vm, -2);
+    lua_pushlightuserdata(vm, const_cast<char *>(&object_cache_key));
+    lua_pushvalue(vm, -2);
+    lua_rawset(vm, LUA_REGISTRYINDEX);
+}
+
+/*
+ * Replaces the class metatable on top of the stack with a wrapper of
+ * object: the cached one when it exists with that metatable, otherwise
+ * a new userdata (holding owner when given) which is then cached.
+ */
+static void wrap(lua_State *vm, const LuaClass *object,
+    const std::shared_ptr<LuaClass> *owner) {
+    int top = lua_gettop(vm);
+    object_cache(vm);
+    lua_pushlightuserdata(vm, const_cast<LuaClass *>(object));
+    lua_rawget(vm, -2);
+    if (lua_type(vm, -1) == LUA_TUSERDATA && lua_getmetatable(vm, -1)) {
+        // A wrapper without an owner can't keep a shared object alive:
+        // replace it rather than drop the owner.
+        if (lua_rawequal(vm, -1, top) && (!owner || handle(vm, -2))) {
+            lua_pop(vm, 1);
+            lua_replace(vm, top);
+            lua_settop(vm, top);
+            object_counters(vm)->hits++;
+            return;
+        }
+    }
+    lua_settop(vm, top);
+    object_counters(vm)->misses++;
+
+    if (owner) {
+        new (lua_newuserdata(vm, sizeof(Handle))) Handle {
+            { owner->get(), true }, *owner };
+    } else {
+        auto data = (Wrapper *)lua_newuserdata(vm, sizeof(Wrapper));
+        *data = { const_cast<LuaClass *>(object), false };
+        const_cast<LuaClass *>(object)->reference();
+    }
+    lua_insert(vm, -2);
+    lua_setmetatable(vm, -2);
+
+    object_cache(vm);
+    lua_pushlightuserdata(vm, const_cast<LuaClass *>(object));
+    lua_pushvalue(vm, -3);
+    lua_rawset(vm, -3);
+    lua_pop(vm, 1);
 }
 
-LuaClass * Lua::object(const int i) {
+void Lua::object(const LuaClass *object, const std::string& name) {
+    if (!object) {
+        lua_pushnil(vm);
+        return;
+    }
+    luaL_getmetatable(vm, name.c_str());
+    if (is_nil())
+        luaL_error(vm, "Invalid object operation (class %s is not exported)!",
+            name.c_str());
+    wrap(vm, object, nullptr);
+}
+
+/* Pushes the metatable cached under key, resolving it by name once. */
+static void cached_metatable(lua_State *vm, const void *key,
+    const std::string (*name)()) {
+    lua_pushlightuserdata(vm, const_cast<void *>(key));
+    lua_rawget(vm, LUA_REGISTRYINDEX);
+    if (!lua_isnil(vm, -1))
+        return;
+    lua_pop(vm, 1);
+    auto class_name = name();
+    luaL_getmetatable(vm, class_name.c_str());
+    if (lua_isnil(vm, -1))
+        luaL_error(vm, "Invalid object operation (class %s is not exported)!",
+            class_name.c_str());
+    lua_pushlightuserdata(vm, const_cast<void *>(key));
+    lua_pushvalue(vm, -2);
+    lua_rawset(vm, LUA_REGISTRYINDEX);
+}
+
+void Lua::object(const std::shared_ptr<LuaClass>& owner, const void *key,
+    const std::string (*name)()) {
+    if (!owner) {
+        lua_pushnil(vm);
+        return;
+    }
+    cached_metatable(vm, key, name);
+    wrap(vm, owner.get(), &owner);
+}
+
+std::shared_ptr<LuaClass> Lua::shared(const int i, const void *key) {
+    auto found = object(i, key);
+    auto owned = handle(vm, i);
+    if (owned)
+        return owned->owner;
+    found->reference();
+    return std::shared_ptr<LuaClass>(found, [] (LuaClass *object) {
+        object->collect();
+    });
+}
+
+void Lua::object(const LuaClass *object, const void *key,
+    const std::string (*name)()) {
+    if (!object) {
+        lua_pushnil(vm);
+        return;
+    }
+    cached_metatable(vm, key, name);
+    wrap(vm, object, nullptr);
+}
+
+Lua::ObjectCacheStatistics Lua::object_cache() {
+    auto counters = object_counters(vm);
+    ObjectCacheStatistics statistics = { counters->hits, counters->misses };
+    return statistics;
+}
+
+LuaClass * Lua::object(const int i, const void *key) {
     if (lua_gettop(vm) - (i>0?i:-i) < 0)
         luaL_error(vm, "Invalid object operation (out of stack)!");
-    if (!lua_istable(vm, i))
-        luaL_error(vm, "Invalid object (table expected)!");
-    load("__self__", i);
-    auto ret = (LuaClass *)userdata();
-    pop();
-    return ret;
+    int t = absolute(i);
+    if (!class_set(vm, t))
+        luaL_argerror(vm, t, "LuaCxx object expected");
+    if (key) {
+        userdata(key);
+        lua_rawget(vm, -2);
+        bool found = lua_toboolean(vm, -1);
+        lua_pop(vm, 1);
+        // A class never exported here has no metatable to compare with.
+        userdata(key);
+        lua_rawget(vm, LUA_REGISTRYINDEX);
+        if (!found && lua_istable(vm, -1)) {
+            lua_getfield(vm, -1, "__name");
+            luaL_argerror(vm, t, lua_pushfstring(vm, "%s expected",
+                lua_tostring(vm, -1)));
+        }
+        lua_pop(vm, 1);
+    }
+    lua_pop(vm, 1);
+    return *(LuaClass **)lua_touserdata(vm, t);
 }
 
 void Lua::userdata(const void *d) {
@@ -165,16 +1528,47 @@ lua_Number Lua::tonumber(const int i) {
     return lua_tonumber(vm, i);
 }
 
+void Lua::integer(const lua_Integer n) {
+    lua_pushinteger(vm, n);
+}
+
+lua_Integer Lua::tointeger(const int i) {
+    if (lua_gettop(vm) - (i>0?i:-i) < 0)
+        luaL_error(vm, "Invalid tointeger operation (out of stack)!");
+    lua_Integer n;
+    if (!integer_at(vm, i, &n))
+        luaL_error(vm, "Invalid tointeger operation (integer expected)!");
+    return n;
+}
+
+lua_Integer Lua::tointeger(const int i, const lua_Integer min,
+    const lua_Integer max) {
+    lua_Integer n = tointeger(i);
+    if (n < min || n > max)
+        luaL_error(vm, "Invalid tointeger operation (integer out of range)!");
+    return n;
+}
+
 void Lua::string(const std::string& string) {
-    lua_pushstring(vm, string.c_str());
+    lua_pushlstring(vm, string.data(), string.size());
+}
+
+void Lua::string(const char *data, const size_t length) {
+    lua_pushlstring(vm, data, length);
 }
 
 std::string Lua::string(const int i) {
+    size_t length;
+    auto data = string(i, &length);
+    return std::string(data, length);
+}
+
+const char * Lua::string(const int i, size_t *length) {
     if (lua_gettop(vm) - (i>0?i:-i) < 0)
         luaL_error(vm, "Invalid string operation (out of stack)!");
     if (!lua_isstring(vm, i))
         luaL_error(vm, "Invalid string operation (string expected)!");
-    return lua_tostring(vm, i);
+    return lua_tolstring(vm, i, length);
 }
 
 void Lua::boolean(const bool b) {
@@ -200,35 +1594,38 @@ const std::string Lua::LuaObject::class_name() {
     return "Object";
 }
 
-void Lua::export_function(const std::string& name, void (*callback)()) {
-    auto function = new std::function<int(Lua&)>([callback] (Lua& vm) -> int {
-        (*callback)();
-        return 0;
-    });
-    lambda(function, name);
-}
-
 template <>
-int Lua::ret<lua_Number>(const lua_Number r) {
+int Lua::ret<lua_Number>(const lua_Number& r) {
     number(r);
     return 1;
 }
 
 template <>
-int Lua::ret<std::string>(const std::string r) {
+int Lua::ret<std::string>(const std::string& r) {
     string(r);
     return 1;
 }
 
 template <>
-int Lua::ret<bool>(const bool r) {
-    boolean(r);
+int Lua::ret<const char *>(const char * const& r) {
+    if (r)
+        lua_pushstring(vm, r);
+    else
+        lua_pushnil(vm);
     return 1;
 }
 
+#if __cplusplus >= 201703L
 template <>
-int Lua::ret<int>(const int r) {
-    number(r);
+int Lua::ret<std::string_view>(const std::string_view& r) {
+    string(r.data(), r.size());
+    return 1;
+}
+#endif
+
+template <>
+int Lua::ret<bool>(const bool& r) {
+    boolean(r);
     return 1;
 }
 
@@ -238,22 +1635,25 @@ std::string Lua::arg<std::string>(const int i) {
 }
 
 template <>
-lua_Number Lua::arg<lua_Number>(const int i) {
-    return tonumber(i);
+const char * Lua::arg<const char *>(const int i) {
+    return string(i, nullptr);
 }
 
+#if __cplusplus >= 201703L
 template <>
-bool Lua::arg<bool>(const int i) {
-    return boolean(i);
+std::string_view Lua::arg<std::string_view>(const int i) {
+    size_t length;
+    auto data = string(i, &length);
+    return std::string_view(data, length);
 }
+#endif
 
 template <>
-lua_Integer Lua::arg<lua_Integer>(const int i) {
+lua_Number Lua::arg<lua_Number>(const int i) {
     return tonumber(i);
 }
 
 template <>
-int Lua::arg<int>(const int i) {
-    return tonumber(i);
+bool Lua::arg<bool>(const int i) {
+    return boolean(i);
 }
-
@@ -1,10 +1,21 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <atomic>
+#include <map>
+#include <memory>
 #include <string>
 #include <vector>
-#include <functional>
 #include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <utility>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 #include <iostream>
 
@@ -14,50 +25,150 @@ extern "C" {
 
 namespace util {
 
+class Lua;
+class LuaAllocator;
+class LuaLoop;
+template <typename Signature> class LuaFunction;
+
+/*
+ * Base of exported classes. Every Lua userdata pointing at an object holds
+ * one reference; once tracking is enabled (objects made by an exported
+ * constructor) the last release deletes it. The count is atomic, so C++
+ * code and states on other threads may hold references too. Objects owned
+ * by a std::shared_ptr are pushed with their owner instead and need no
+ * tracking.
+ */
 class LuaClass {
 private:
-    unsigned int references;
-    bool track_references;
+    std::atomic<unsigned int> references;
+    std::atomic<bool> track_references;
 protected:
 public:
     LuaClass():
         references(0),
         track_references(false)
     {}
+    LuaClass(const LuaClass&):
+        references(0),
+        track_references(false)
+    {}
+    LuaClass& operator=(const LuaClass&) {
+        return *this;
+    }
+    virtual ~LuaClass() {}
+
     void enable_tracking() {
-        track_references = true;
+        track_references.store(true, std::memory_order_relaxed);
     }
     void reference() {
-        references++;
+        references.fetch_add(1, std::memory_order_relaxed);
     }
     void collect() {
-        if (track_references && !--references)
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1
+            && track_references.load(std::memory_order_relaxed))
             delete this;
     }
 };
 
+/*
+ * On-disk cache of precompiled chunks for Lua::file. Entries are keyed by
+ * source path and validated against the source size, mtime and content
+ * hash; stale or unreadable entries fall back to compiling the source.
+ * One cache may be shared by any number of states.
+ */
+class LuaChunkCache {
+private:
+    std::string directory;
+    std::atomic<unsigned long> hit;
+    std::atomic<unsigned long> miss;
+
+    friend class Lua;
+public:
+    LuaChunkCache(const std::string& directory);
+
+    unsigned long hits() const;
+    unsigned long misses() const;
+};
+
+/*
+ * Accessor record of an exported field: the typed get/set trampolines and
+ * the member pointer(s) they apply. set is null for read-only fields.
+ */
+struct LuaField {
+    int (*get)(Lua& vm, LuaClass *object, const void *accessor);
+    void (*set)(Lua& vm, LuaClass *object, const void *accessor,
+        const int i);
+    char accessor[4 * sizeof(void *)];
+};
+
 class Lua {
+    friend class LuaLoop;
+    template <typename Signature> friend class LuaFunction;
 protected:
+    /*
+     * Conversions without an explicit ret/arg specialization. Class
+     * templates can be partially specialized, so containers are handled
+     * here; everything else is a LuaClass pointer or a userdata copy.
+     */
+    template <typename T, typename Enable = void> struct marshal {
+        static int ret(Lua& vm, const T& r) {
+            static_assert(std::is_convertible<T, LuaClass*>::value,
+                "LuaClass * required!");
+            typedef typename std::remove_pointer<T>::type Type;
+            vm.object((LuaClass *)r, class_key<Type>(), &Type::class_name);
+            return 1;
+        }
+
+        static T arg(Lua& vm, const int i) {
+            if (std::is_base_of<util::LuaClass, T>::value) {
+                return *(T *)vm.object(i, class_key<T>());
+            } else {
+                return *(T *)vm.userdata(i);
+            }
+        }
+    };
+
     template <typename T>
-    int ret(const T r) {
-        static_assert(std::is_convertible<T, LuaClass*>::value,
-            "LuaClass * required!");
-        object((LuaClass *)r, std::remove_pointer<T>::type::class_name());
-        return 1;
+    int ret(const T& r) {
+        return marshal<T>::ret(*this, r);
     }
     template <class T>
     T arg(const int i) {
-        if (std::is_base_of<util::LuaClass, T>::value) {
-            return *(T *)object(i);
-        } else {
-            return *(T *)userdata(i);
-        }
+        return marshal<T>::arg(*this, i);
     }
 
+    template <typename M> struct marshal_map {
+        static int ret(Lua& vm, const M& r) {
+            vm.table(0, r.size());
+            for (auto& item : r) {
+                vm.ret<typename M::key_type>(item.first);
+                vm.ret<typename M::mapped_type>(item.second);
+                lua_rawset(vm.vm, -3);
+            }
+            return 1;
+        }
+
+        static M arg(Lua& vm, const int i) {
+            int t = vm.absolute(i);
+            vm.check_table(t);
+            M r;
+            lua_pushnil(vm.vm);
+            while (lua_next(vm.vm, t)) {
+                // Convert a copy of the key: tolstring on the key itself
+                // would confuse lua_next.
+                vm.copy(-2);
+                r.emplace(vm.arg<typename M::key_type>(-1),
+                    vm.arg<typename M::mapped_type>(-2));
+                vm.pop(2);
+            }
+            return r;
+        }
+    };
+
     template <class T>
     T* argp(const int i) {
         if (std::is_base_of<util::LuaClass, T>::value) {
-            return (T *)object(i);
+            return (T *)object(i, class_key<T>());
         } else {
             return (T *)userdata(i);
         }
@@ -65,7 +176,8 @@ protected:
 
     template <typename T, typename T1, typename... Args>
     std::tuple<T, T1, Args...> args(const int i = 1) {
-        return std::tuple_cat(arg<T>(i), args<T1, Args...>(i + 1));
+        return std::tuple_cat(std::tuple<T>(arg<T>(i)),
+            args<T1, Args...>(i + 1));
     }
 
     template <typename T>
@@ -73,11 +185,17 @@ protected:
         return std::tuple<T>(arg<T>(i));
     }
 
+    template <typename... Args>
+    typename std::enable_if<!sizeof...(Args), std::tuple<>>::type
+    args(const int i = 1) {
+        return std::tuple<>();
+    }
+
     template <int N> struct apply_method {
         template <class T, typename R, typename... MethodArgs,
             typename... TupleArgs, typename... Args>
         static R apply(T* o, R (T::*method)(MethodArgs...),
-            std::tuple<TupleArgs...>& t, Args... args) {
+            std::tuple<TupleArgs...>& t, Args&... args) {
             return apply_method<N-1>::
                 apply(o, method, t, std::get<N-1>(t), args...);
         }
@@ -87,7 +205,7 @@ protected:
         template <typename R, typename... FunctionArgs, typename... TupleArgs,
             typename... Args>
         static R apply(R (*function)(FunctionArgs...),
-            std::tuple<TupleArgs...>& t, Args... args) {
+            std::tuple<TupleArgs...>& t, Args&... args) {
             return apply_function<N-1>::
                 apply(function, t, std::get<N-1>(t), args...);
         }
@@ -95,40 +213,343 @@ protected:
 
     template <int N, class T> struct apply_constructor {
         template <typename... TupleArgs, typename... Args>
-        static T * apply(std::tuple<TupleArgs...>& t, Args... args) {
+        static T * apply(std::tuple<TupleArgs...>& t, Args&... args) {
             return apply_constructor<N-1, T>::
                 apply(t, std::get<N-1>(t), args...);
         }
     };
 
+    /*
+     * Call trampolines: one static lua_CFunction per bound signature.
+     * The function or member pointer itself is kept in the first upvalue
+     * of the closure, so binding allocates nothing on the C++ heap and a
+     * call is a direct (non type-erased) invocation.
+     */
+    template <typename R, typename... Args>
+    struct function_binding {
+        typedef R (*Function)(Args...);
+
+        static int call(lua_State *state) {
+            Lua vm(state);
+            auto function = *(Function *)vm.upvalue();
+            auto tuple = vm.args<typename std::decay<Args>::type...>();
+            return vm.ret(
+                apply_function<sizeof...(Args)>::apply(function, tuple));
+        }
+    };
+
+    template <typename R, class T, typename... Args>
+    struct method_binding {
+        typedef R (T::*Method)(Args...);
+
+        static int call(lua_State *state) {
+            Lua vm(state);
+            auto method = *(Method *)vm.upvalue();
+            auto tuple = vm.args<typename std::decay<Args>::type...>(2);
+            return vm.ret(
+                apply_method<sizeof...(Args)>
+                    ::apply(vm.argp<T>(1), method, tuple));
+        }
+    };
+
+    template <class T, typename... Args>
+    struct constructor_binding {
+        static int call(lua_State *state) {
+            Lua vm(state);
+            auto tuple = vm.args<typename std::decay<Args>::type...>();
+            T *object = apply_constructor<sizeof...(Args), T>::apply(tuple);
+            static_cast<LuaClass *>(object)->enable_tracking();
+            return vm.ret(object);
+        }
+    };
+
+    template <int N> struct push_arguments {
+        template <typename... TupleArgs>
+        static int push(Lua& vm, const std::tuple<TupleArgs...>& t) {
+            int n = push_arguments<N-1>::push(vm, t);
+            return n + vm.ret(std::get<N-1>(t));
+        }
+    };
+
+    /*
+     * Whether R may be read from a result that is popped right after: a
+     * const char * or string_view would point into a string the GC is free
+     * to collect, so results like that must be std::string.
+     */
+    template <typename R> struct owned_result : std::true_type {};
+
+    /*
+     * Calls the function below it on the stack with the tuple as arguments
+     * and converts the result. Run through protect(), so errors raised by
+     * the script or by the conversion reach the caller as exceptions.
+     */
+    template <typename R, typename... Args>
+    struct invocation {
+        static_assert(owned_result<R>::value,
+            "Borrowed string results would dangle, use std::string!");
+        const std::tuple<Args...> *args;
+        R value;
+
+        static void run(Lua& vm, void *data) {
+            auto self = (invocation *)data;
+            int n = push_arguments<sizeof...(Args)>::push(vm, *self->args);
+            lua_call(vm.vm, n, 1);
+            self->value = vm.arg<R>(-1);
+            vm.pop();
+        }
+
+        R result() {
+            return value;
+        }
+    };
+
+    template <class T, typename M>
+    struct field_binding {
+        typedef M T::*Member;
+        typedef typename std::remove_cv<M>::type Value;
+
+        static int get(Lua& vm, LuaClass *object, const void *accessor) {
+            auto member = *(const Member *)accessor;
+            return vm.ret<Value>(static_cast<T *>(object)->*member);
+        }
+
+        static void set(Lua& vm, LuaClass *object, const void *accessor,
+            const int i) {
+            auto member = *(const Member *)accessor;
+            static_cast<T *>(object)->*member = vm.arg<Value>(i);
+        }
+    };
+
+    template <class T, typename R, typename A>
+    struct property_binding {
+        typedef typename std::decay<R>::type Result;
+        typedef typename std::decay<A>::type Argument;
+
+        struct Accessor {
+            R (T::*getter)() const;
+            void (T::*setter)(A);
+        };
+
+        static int get(Lua& vm, LuaClass *object, const void *accessor) {
+            auto getter = ((const Accessor *)accessor)->getter;
+            return vm.ret<Result>((static_cast<T *>(object)->*getter)());
+        }
+
+        static void set(Lua& vm, LuaClass *object, const void *accessor,
+            const int i) {
+            auto setter = ((const Accessor *)accessor)->setter;
+            (static_cast<T *>(object)->*setter)(vm.arg<Argument>(i));
+        }
+    };
+
+    template <typename R> struct batch_store {
+        static_assert(owned_result<R>::value,
+            "Borrowed string results would dangle, use std::string!");
+        static void store(Lua& vm, R *outputs, const size_t i) {
+            outputs[i] = vm.arg<R>(-1);
+        }
+    };
+
+    /*
+     * One element of a batch, run under lua_pcall with the target function
+     * as upvalue; a failing call or result conversion only costs that
+     * element.
+     */
+    template <typename R, typename... Args>
+    struct batch_step {
+        const std::tuple<Args...> *inputs;
+        R *outputs;
+        size_t index;
+
+        static int call(lua_State *state) {
+            Lua vm(state);
+            auto self = (batch_step *)vm.userdata(1);
+            lua_pushvalue(state, lua_upvalueindex(1));
+            int n = push_arguments<sizeof...(Args)>::
+                push(vm, self->inputs[self->index]);
+            lua_call(state, n, 1);
+            batch_store<R>::store(vm, self->outputs, self->index);
+            return 0;
+        }
+    };
+
+    /*
+     * Registry key of the class metatable cache entry for T: the address
+     * of a per-type static, so the lookup hashes a pointer rather than the
+     * class name.
+     */
+    template <class T>
+    static const void * class_key() {
+        static const char key = 0;
+        return &key;
+    }
+
+    template <typename T>
+    struct ffi_type {
+        static_assert(sizeof(T) == 0,
+            "Only scalar types can be passed through the FFI!");
+    };
+
+    /*
+     * Whether every type crosses the FFI as a plain Lua value: 64-bit
+     * integers come back as boxed int64_t cdata, which type(), table keys
+     * and string.format treat differently from numbers.
+     */
+    template <typename... T> struct ffi_plain : std::true_type {};
+    template <typename T, typename... Rest> struct ffi_plain<T, Rest...> :
+        std::integral_constant<bool, (!std::is_integral<T>::value
+            || sizeof(T) <= 4) && ffi_plain<Rest...>::value> {};
+
 private:
     bool del;
     lua_State * vm;
-    std::vector<std::function<int(Lua&)> *> lambdas;
 
-    static int call(lua_State *vm);
+    void protect(void (*function)(Lua&, void *), void *data, const int n);
+    void field(const std::string& name, const LuaField& field);
+    void inherit_fields(const std::string& parent);
+    void flatten(const std::string& parent);
+
+    bool ffi(const std::string& name, const char *result,
+        const char * const *args, const void *function);
+
+public:
+    /*
+     * How export_class makes parent methods visible: Chained looks them up
+     * through one __index hop per ancestor, Flattened copies them into the
+     * class table at export time so any method is a single lookup.
+     */
+    enum Inheritance {
+        Chained,
+        Flattened
+    };
+
+    /*
+     * Field name pre-interned as a registry reference. Obtained once
+     * through intern() and passed to load/save instead of a std::string,
+     * so the hot path neither builds a string nor rehashes the key.
+     */
+    struct Name {
+        int ref;
+    };
+
+    struct BatchError {
+        size_t index;
+        std::string message;
+    };
+
+private:
+    std::vector<BatchError> run_batch(const int reference, lua_CFunction step,
+        void *context, size_t *index, const size_t count);
 public:
+
     Lua(lua_State *vm);
     Lua();
+    Lua(lua_Alloc allocator, void *data);
+    Lua(LuaAllocator& allocator);
     ~Lua();
 
-    void lambda(std::function<int(Lua&)> *function, const std::string& name);
+    lua_State * state() const;
+
+    void bind(lua_CFunction function, const void *data, const size_t size,
+        const std::string& name);
+    void * upvalue(const int i = 1);
+
+    /*
+     * Per-binding call statistics. Every bound function and method is
+     * dispatched through its record; while instrumentation is off (the
+     * default, process-wide) that costs one flag check, plus one for a
+     * pending profiler sample. histogram[i] counts calls that took
+     * [2^i, 2^(i+1)) nanoseconds.
+     */
+    struct BindingStats {
+        std::string name;
+        unsigned long calls;
+        uint64_t total_ns;
+        uint64_t histogram[32];
+    };
+    static void instrument(const bool enabled);
+    static bool instrumented();
+    std::vector<BindingStats> stats(const bool reset = false);
+
+    Name intern(const std::string& name);
+
+    /* Registry references: ref() pops the top value, deref() pushes it. */
+    int ref();
+    void deref(const int reference);
+    void unref(const int reference);
 
+    void global(const std::string& name);
+    /* Pushes the table of globals. */
+    void globals();
     void load(const std::string& name, const int i = -1);
+    void load(const Name& name, const int i = -1);
     void pop(const int i = 1);
     void remove(const int i);
     void table();
+    /* Table presized for narr array and nrec hash entries. */
+    void table(const int narr, const int nrec);
+    size_t length(const int i = -1);
+    int absolute(const int i);
+    void check_table(const int i);
     void metatable(const int i = -2);
+    void class_metatable(const std::string& name, const void *key,
+        const void *parent = nullptr);
     void closure(int (*)(lua_State *), const int i = 1);
     void copy(const int i = -1);
     void save(const std::string& name, const int i = -2);
+    void save(const Name& name, const int i = -2);
 
     void file(const std::string& name);
+    void file(const std::string& name, LuaChunkCache& cache);
+    /*
+     * Runs a script or precompiled chunk already held in memory (embedded
+     * in the binary, received over IPC, ...) without copying it.
+     */
+    void buffer(const char *data, const size_t size, const std::string& name);
 
     bool is_nil(const int i = -1);
 
+    /*
+     * Compact binary snapshot of the value at i: nil, booleans, numbers,
+     * strings and acyclic tables of those, with repeated strings stored
+     * once. Like snprintf, writes at most size bytes and returns the size
+     * of the whole encoding, so a short buffer can be grown and retried.
+     * Other types and cycles throw std::runtime_error.
+     */
+    size_t serialize(const int i, char *buffer, const size_t size);
+    std::string serialize(const int i = -1);
+    /* Pushes the value encoded in data; malformed data throws. */
+    void deserialize(const char *data, const size_t size);
+
     void object(const LuaClass *, const std::string& name);
-    LuaClass * object(const int i = -1);
+    void object(const LuaClass *, const void *key,
+        const std::string (*name)());
+    void object(const std::shared_ptr<LuaClass>& owner, const void *key,
+        const std::string (*name)());
+    /*
+     * Objects are wrapped once per state: pushing an object that already
+     * has a live wrapper of the same class reuses it (tracked by address
+     * in a weak-valued registry table).
+     */
+    struct ObjectCacheStatistics {
+        unsigned long hits;
+        unsigned long misses;
+    };
+    ObjectCacheStatistics object_cache();
+
+    /* Owner of the object at i; intrusive objects get a referencing one. */
+    std::shared_ptr<LuaClass> shared(const int i,
+        const void *key = nullptr);
+
+    template <class T>
+    void object(const std::shared_ptr<T>& owner) {
+        marshal<std::shared_ptr<T>>::ret(*this, owner);
+    }
+    /*
+     * Object at i; anything but a LuaCxx object, or one of a class not
+     * derived from the one under key, raises an argument error.
+     */
+    LuaClass * object(const int i = -1, const void *key = nullptr);
 
     void userdata(const void *);
     void * userdata(const int i = -1);
@@ -136,8 +557,16 @@ public:
     void number(const lua_Number);
     lua_Number tonumber(const int i = -1);
 
+    void integer(const lua_Integer);
+    lua_Integer tointeger(const int i = -1);
+    /* Integer at i, raising a Lua error outside [min, max]. */
+    lua_Integer tointeger(const int i, const lua_Integer min,
+        const lua_Integer max);
+
     void string(const std::string&);
+    void string(const char *data, const size_t length);
     std::string string(const int i = -1);
+    const char * string(const int i, size_t *length);
 
     void boolean(const bool);
     bool boolean(const int i = -1);
@@ -172,7 +601,7 @@ public:
      *          -> T::export_class(;
      */
 
-    template<class T, class P = LuaObject>
+    template<class T, class P = LuaObject, Inheritance I = Chained>
     void export_class() {
         static_assert(std::is_base_of<util::LuaClass, T>::value,
             "LuaClass implementation expected!");
@@ -185,7 +614,7 @@ public:
             P::export_me(*this);
         }
 
-        load(name);
+        global(name);
         if (!is_nil()) {
             pop();
             return;
@@ -193,16 +622,18 @@ public:
         pop();
 
         table();
-        table();
-        copy(-2);
-        save("__index");
+        class_metatable(name, class_key<T>(),
+            parent ? class_key<P>() : nullptr);
         save("mtab");
 
         if (parent) {
-            load(parent_name);
-            load("mtab");
-            metatable(-3);
-            pop();
+            table();
+            global(parent_name);
+            save("__index");
+            metatable();
+            inherit_fields(parent_name);
+            if (I == Flattened)
+                flatten(parent_name);
         }
 
         T::export_class(*this);
@@ -213,131 +644,343 @@ public:
     template <typename R, class T, typename... Args>
     void export_method(const std::string& name,
         R (T::*method)(Args...)) {
-        auto function = new std::function<int(Lua&)>([method] (Lua& vm) -> int {
-            auto tuple = vm.args<Args...>(2);
-            return vm.ret(
-                apply_method<sizeof...(Args)>
-                    ::apply(vm.argp<T>(1), method, tuple));
-        });
-        lambda(function, name);
+        bind(method_binding<R, T, Args...>::call,
+            &method, sizeof(method), name);
     }
 
-    template <class T, typename... Args>
-    void export_method(const std::string& name,
-        void (T::*method)(Args...)) {
-        auto function = new std::function<int(Lua&)>([method] (Lua& vm) -> int {
-            auto tuple = vm.args<Args...>(2);
-            apply_method<sizeof...(Args)>::apply(vm.argp<T>(1), method, tuple);
-            return 0;
-        });
-        lambda(function, name);
+    /*
+     * Data members and getter/setter pairs read and written from scripts
+     * as obj.name. Fields of a class are served by one C __index and
+     * __newindex pair that finds the accessor through a perfect hash of
+     * the interned name; other keys fall back to the class table.
+     */
+    template <class T, typename M>
+    void export_field(const std::string& name, M T::*member) {
+        LuaField field = { field_binding<T, M>::get,
+            field_binding<T, M>::set, {} };
+        static_assert(sizeof(member) <= sizeof(field.accessor),
+            "Member pointer too large!");
+        memcpy(field.accessor, &member, sizeof(member));
+        this->field(name, field);
     }
 
-    template <typename R, class T>
-    void export_method(const std::string& name, R (T::*method)()) {
-        auto function = new std::function<int(Lua&)>([method] (Lua& vm) -> int {
-            return vm.ret((vm.argp<T>(1)->*method)());
-        });
-        lambda(function, name);
+    template <class T, typename M>
+    void export_readonly(const std::string& name, M T::*member) {
+        LuaField field = { field_binding<T, M>::get, nullptr, {} };
+        static_assert(sizeof(member) <= sizeof(field.accessor),
+            "Member pointer too large!");
+        memcpy(field.accessor, &member, sizeof(member));
+        this->field(name, field);
     }
 
-    template <class T>
-    void export_method(const std::string& name, void (T::*method)()) {
-        auto function = new std::function<int(Lua&)>([method] (Lua& vm) -> int {
-            (vm.argp<T>(1)->*method)();
-            return 0;
-        });
-        lambda(function, name);
+    template <class T, typename R, typename A>
+    void export_property(const std::string& name, R (T::*getter)() const,
+        void (T::*setter)(A)) {
+        typedef property_binding<T, R, A> Binding;
+        typename Binding::Accessor accessor = { getter, setter };
+        LuaField field = { Binding::get, Binding::set, {} };
+        static_assert(sizeof(accessor) <= sizeof(field.accessor),
+            "Accessor too large!");
+        memcpy(field.accessor, &accessor, sizeof(accessor));
+        this->field(name, field);
+    }
+
+    template <class T, typename R>
+    void export_property(const std::string& name, R (T::*getter)() const) {
+        typedef property_binding<T, R, const R&> Binding;
+        typename Binding::Accessor accessor = { getter, nullptr };
+        LuaField field = { Binding::get, nullptr, {} };
+        static_assert(sizeof(accessor) <= sizeof(field.accessor),
+            "Accessor too large!");
+        memcpy(field.accessor, &accessor, sizeof(accessor));
+        this->field(name, field);
     }
 
     template <typename R, typename... Args>
     void export_function(const std::string& name,
         R (*callback)(Args...)) {
-        auto function = new std::function<int(Lua&)>([callback] (Lua& vm) -> int {
-            auto tuple = vm.args<Args...>();
-            return vm.ret(
-                apply_function<sizeof...(Args)>::apply(callback, tuple));
-        });
-        lambda(function, name);
+        bind(function_binding<R, Args...>::call,
+            &callback, sizeof(callback), name);
     }
 
-    template <typename... Args>
-    void export_function(const std::string& name,
-        void (*callback)(Args...)) {
-        auto function = new std::function<int(Lua&)>([callback] (Lua& vm) -> int {
-            auto tuple = vm.args<Args...>();
-            apply_function<sizeof...(Args)>
-                ::apply(callback, tuple);
-            return 0;
-        });
-        lambda(function, name);
+    /*
+     * Binds a function with a plain scalar signature (e.g. int(int),
+     * double(double, double)) as an FFI function pointer when the state
+     * runs on LuaJIT, so JIT-compiled code calls it directly instead of
+     * going through the C API. Falls back to export_function elsewhere,
+     * and for 64-bit integer types, so results keep the same Lua types.
+     * Strings and LuaClass objects are not FFI types: use export_function.
+     */
+    template <typename R, typename... Args>
+    void export_ffi_function(const std::string& name,
+        R (*callback)(Args...)) {
+        const char *args[] = { ffi_type<Args>::name()..., nullptr };
+        if (!ffi_plain<R, Args...>::value
+            || !ffi(name, ffi_type<R>::name(), args, (const void *)callback))
+            export_function(name, callback);
     }
 
-    template <typename R>
-    void export_function(const std::string& name, R (*callback)()) {
-        auto function = new std::function<int(Lua&)>([callback] (Lua& vm) -> int {
-            return vm.ret((*callback)());
-        });
-        lambda(function, name);
+    template <class T, typename... Args>
+    void export_constructor() {
+        closure(constructor_binding<T, Args...>::call, 0);
+        save("new");
     }
 
-    void export_function(const std::string& name, void (*callback)());
+    /*
+     * Calls the global function name from C++ and converts its result.
+     * Lua errors (from the script or the conversion) are thrown as
+     * std::runtime_error.
+     */
+    template <typename R, typename... Args>
+    R call(const std::string& name, const Args&... args) {
+        return apply<R>(name,
+            std::tuple<typename std::decay<Args>::type...>(args...));
+    }
 
-    template <class T, typename Arg1, typename... Args>
-    void export_constructor() {
-        auto function = new std::function<int(Lua&)>([] (Lua& vm) -> int {
-            auto tuple = vm.args<Arg1, Args...>(1);
-            T *object =
-                apply_constructor<sizeof...(Args), T>::apply(tuple);
-            static_cast<LuaClass *>(object)->enable_tracking();
-            return vm.ret(object);
-        });
-        lambda(function, "new");
+    template <typename R, typename... Args>
+    R apply(const std::string& name, const std::tuple<Args...>& args) {
+        global(name);
+        invocation<R, Args...> call = { &args };
+        protect(invocation<R, Args...>::run, &call, 1);
+        return call.result();
     }
 
-    template <class T>
-    void export_constructor() {
-        auto function = new std::function<int(Lua&)>([] (Lua& vm) -> int {
-            T *object = new T();
-            static_cast<LuaClass *>(object)->enable_tracking();
-            return vm.ret(object);
-        });
-        lambda(function, "new");
+    /*
+     * Calls function once per input tuple, storing results in outputs
+     * (unused for void). The closure is set up once for the whole batch;
+     * elements that fail are reported instead of aborting the rest.
+     */
+    template <typename R, typename... Args>
+    std::vector<BatchError> batch(const LuaFunction<R(Args...)>& function,
+        const std::tuple<typename std::decay<Args>::type...> *inputs,
+        const size_t count, R *outputs) {
+        typedef batch_step<R, typename std::decay<Args>::type...> Step;
+        Step step = { inputs, outputs, 0 };
+        return run_batch(function.reference, Step::call, &step, &step.index,
+            count);
+    }
+};
+
+template <typename T, typename A> struct Lua::marshal<std::vector<T, A>> {
+    static int ret(Lua& vm, const std::vector<T, A>& r) {
+        vm.table(r.size(), 0);
+        int k = 0;
+        for (const T& item : r) {
+            vm.ret<T>(item);
+            lua_rawseti(vm.vm, -2, ++k);
+        }
+        return 1;
+    }
+
+    static std::vector<T, A> arg(Lua& vm, const int i) {
+        int t = vm.absolute(i);
+        vm.check_table(t);
+        size_t n = vm.length(t);
+        std::vector<T, A> r;
+        r.reserve(n);
+        for (size_t k = 1; k <= n; k++) {
+            lua_rawgeti(vm.vm, t, k);
+            r.push_back(vm.arg<T>(-1));
+            vm.pop();
+        }
+        return r;
+    }
+};
+
+template <typename T, size_t N> struct Lua::marshal<std::array<T, N>> {
+    static int ret(Lua& vm, const std::array<T, N>& r) {
+        vm.table(N, 0);
+        for (size_t k = 0; k < N; k++) {
+            vm.ret<T>(r[k]);
+            lua_rawseti(vm.vm, -2, k + 1);
+        }
+        return 1;
+    }
+
+    static std::array<T, N> arg(Lua& vm, const int i) {
+        int t = vm.absolute(i);
+        vm.check_table(t);
+        std::array<T, N> r;
+        for (size_t k = 0; k < N; k++) {
+            lua_rawgeti(vm.vm, t, k + 1);
+            r[k] = vm.arg<T>(-1);
+            vm.pop();
+        }
+        return r;
+    }
+};
+
+/*
+ * shared_ptr arguments and results: the userdata keeps a copy of the owner,
+ * so every state holding the object keeps it alive and the last one to
+ * collect it destroys it.
+ */
+template <typename T> struct Lua::marshal<std::shared_ptr<T>> {
+    static int ret(Lua& vm, const std::shared_ptr<T>& r) {
+        vm.object(std::shared_ptr<LuaClass>(r), class_key<T>(),
+            &T::class_name);
+        return 1;
+    }
+
+    static std::shared_ptr<T> arg(Lua& vm, const int i) {
+        return std::static_pointer_cast<T>(vm.shared(i, class_key<T>()));
+    }
+};
+
+template <typename K, typename V, typename C, typename A>
+struct Lua::marshal<std::map<K, V, C, A>>:
+    public Lua::marshal_map<std::map<K, V, C, A>> {};
+
+template <typename K, typename V, typename H, typename E, typename A>
+struct Lua::marshal<std::unordered_map<K, V, H, E, A>>:
+    public Lua::marshal_map<std::unordered_map<K, V, H, E, A>> {};
+
+/*
+ * Tuples and pairs are returned as multiple values, one per element, so a
+ * binding like (ok, value, err) allocates no table or object. They only
+ * make sense as the whole result of a binding, not inside a container.
+ */
+template <typename... T> struct Lua::marshal<std::tuple<T...>> {
+    static int ret(Lua& vm, const std::tuple<T...>& r) {
+        return push_arguments<sizeof...(T)>::push(vm, r);
+    }
+};
+
+template <typename A, typename B> struct Lua::marshal<std::pair<A, B>> {
+    static int ret(Lua& vm, const std::pair<A, B>& r) {
+        int n = vm.ret<A>(r.first);
+        return n + vm.ret<B>(r.second);
+    }
+};
+
+/*
+ * Every integral type but bool (which has its own conversions) is a Lua
+ * integer. Types narrower than lua_Integer reject values they can't hold
+ * instead of truncating them.
+ */
+template <typename T>
+struct Lua::marshal<T, typename std::enable_if<std::is_integral<T>::value
+    && !std::is_same<T, bool>::value>::type> {
+    static int ret(Lua& vm, const T& r) {
+        vm.integer(r);
+        return 1;
+    }
+
+    static T arg(Lua& vm, const int i) {
+        if (sizeof(T) >= sizeof(lua_Integer))
+            return vm.tointeger(i);
+        return vm.tointeger(i, std::numeric_limits<T>::min(),
+            std::numeric_limits<T>::max());
+    }
+};
+
+template <> struct Lua::owned_result<const char *> : std::false_type {};
+#if __cplusplus >= 201703L
+template <> struct Lua::owned_result<std::string_view> : std::false_type {};
+#endif
+
+template <> struct Lua::batch_store<void> {
+    static void store(Lua& vm, void *outputs, const size_t i) {
     }
 };
 
 template <>
-int Lua::ret<lua_Number>(const lua_Number r);
+int Lua::ret<lua_Number>(const lua_Number& r);
 
 template <>
-int Lua::ret<std::string>(const std::string r);
+int Lua::ret<std::string>(const std::string& r);
 
 template <>
-int Lua::ret<bool>(const bool r);
+int Lua::ret<bool>(const bool& r);
 
 template <>
-int Lua::ret<int>(const int r);
+int Lua::ret<const char *>(const char * const& r);
 
 template <>
 std::string Lua::arg<std::string>(const int i);
 
+template <>
+const char * Lua::arg<const char *>(const int i);
+
 template <>
 lua_Number Lua::arg<lua_Number>(const int i);
 
 template <>
-lua_Integer Lua::arg<lua_Integer>(const int i);
+bool Lua::arg<bool>(const int i);
 
+#if __cplusplus >= 201703L
 template <>
-int Lua::arg<int>(const int i);
+int Lua::ret<std::string_view>(const std::string_view& r);
 
 template <>
-bool Lua::arg<bool>(const int i);
+std::string_view Lua::arg<std::string_view>(const int i);
+#endif
+
+template <> struct Lua::ffi_type<void> {
+    static const char * name() { return "void"; }
+};
+
+template <> struct Lua::ffi_type<bool> {
+    static const char * name() { return "bool"; }
+};
+
+template <> struct Lua::ffi_type<char> {
+    static const char * name() { return "char"; }
+};
+
+template <> struct Lua::ffi_type<signed char> {
+    static const char * name() { return "int8_t"; }
+};
+
+template <> struct Lua::ffi_type<unsigned char> {
+    static const char * name() { return "uint8_t"; }
+};
+
+template <> struct Lua::ffi_type<short> {
+    static const char * name() { return "short"; }
+};
+
+template <> struct Lua::ffi_type<unsigned short> {
+    static const char * name() { return "unsigned short"; }
+};
+
+template <> struct Lua::ffi_type<int> {
+    static const char * name() { return "int"; }
+};
+
+template <> struct Lua::ffi_type<unsigned int> {
+    static const char * name() { return "unsigned int"; }
+};
+
+template <> struct Lua::ffi_type<long> {
+    static const char * name() { return "long"; }
+};
+
+template <> struct Lua::ffi_type<unsigned long> {
+    static const char * name() { return "unsigned long"; }
+};
+
+template <> struct Lua::ffi_type<long long> {
+    static const char * name() { return "long long"; }
+};
+
+template <> struct Lua::ffi_type<unsigned long long> {
+    static const char * name() { return "unsigned long long"; }
+};
+
+template <> struct Lua::ffi_type<float> {
+    static const char * name() { return "float"; }
+};
+
+template <> struct Lua::ffi_type<double> {
+    static const char * name() { return "double"; }
+};
 
 template <> struct Lua::apply_method<0> {
     template <class T, typename R, typename... MethodArgs,
         typename... TupleArgs, typename... Args>
     static R apply(T* o, R (T::*method)(MethodArgs...),
-        std::tuple<TupleArgs...>& t, Args... args) {
+        std::tuple<TupleArgs...>& t, Args&... args) {
         return (o->*method)(args...);
     }
 };
@@ -346,18 +989,122 @@ template <> struct Lua::apply_function<0> {
     template <typename R, typename... FunctionArgs, typename... TupleArgs,
         typename... Args>
     static R apply(R (*function)(FunctionArgs...),
-        std::tuple<TupleArgs...>& t, Args... args) {
+        std::tuple<TupleArgs...>& t, Args&... args) {
         return
             (*function)(args...);
     }
 };
 
+template <typename... Args>
+struct Lua::function_binding<void, Args...> {
+    typedef void (*Function)(Args...);
+
+    static int call(lua_State *state) {
+        Lua vm(state);
+        auto function = *(Function *)vm.upvalue();
+        auto tuple = vm.args<typename std::decay<Args>::type...>();
+        apply_function<sizeof...(Args)>::apply(function, tuple);
+        return 0;
+    }
+};
+
+template <class T, typename... Args>
+struct Lua::method_binding<void, T, Args...> {
+    typedef void (T::*Method)(Args...);
+
+    static int call(lua_State *state) {
+        Lua vm(state);
+        auto method = *(Method *)vm.upvalue();
+        auto tuple = vm.args<typename std::decay<Args>::type...>(2);
+        apply_method<sizeof...(Args)>::apply(vm.argp<T>(1), method, tuple);
+        return 0;
+    }
+};
+
+template <> struct Lua::push_arguments<0> {
+    template <typename... TupleArgs>
+    static int push(Lua& vm, const std::tuple<TupleArgs...>& t) {
+        return 0;
+    }
+};
+
+template <typename... Args>
+struct Lua::invocation<void, Args...> {
+    const std::tuple<Args...> *args;
+
+    static void run(Lua& vm, void *data) {
+        auto self = (invocation *)data;
+        int n = push_arguments<sizeof...(Args)>::push(vm, *self->args);
+        lua_call(vm.vm, n, 0);
+    }
+
+    void result() {
+    }
+};
+
 template <class T> struct Lua::apply_constructor<0, T> {
     template <typename... TupleArgs, typename... Args>
-    static T * apply(std::tuple<TupleArgs...>& t, Args... args) {
+    static T * apply(std::tuple<TupleArgs...>& t, Args&... args) {
         return new T(args...);
     }
 };
 
+/*
+ * Handle to a Lua function held through a registry reference, so calls
+ * skip the global lookup. Arguments are pushed and the result converted
+ * with the same ret/arg specializations bindings use; Lua errors are
+ * thrown as std::runtime_error. Must not outlive its state.
+ */
+template <typename R, typename... Args>
+class LuaFunction<R(Args...)> {
+private:
+    friend class Lua;
+
+    lua_State *state;
+    int reference;
+public:
+    LuaFunction(Lua& vm, const std::string& name): state(vm.state()) {
+        vm.global(name);
+        reference = vm.ref();
+    }
+
+    LuaFunction(Lua& vm, const int i): state(vm.state()) {
+        vm.copy(i);
+        reference = vm.ref();
+    }
+
+    LuaFunction(const LuaFunction& function): state(function.state) {
+        Lua vm(state);
+        vm.deref(function.reference);
+        reference = vm.ref();
+    }
+
+    LuaFunction& operator=(const LuaFunction& function) {
+        if (this != &function) {
+            Lua vm(function.state);
+            vm.deref(function.reference);
+            int copy = vm.ref();
+            Lua(state).unref(reference);
+            state = function.state;
+            reference = copy;
+        }
+        return *this;
+    }
+
+    ~LuaFunction() {
+        Lua(state).unref(reference);
+    }
+
+    R operator()(const Args&... args) const {
+        typedef Lua::invocation<R, const Args&...> Invocation;
+        Lua vm(state);
+        std::tuple<const Args&...> arguments(args...);
+        Invocation call = { &arguments };
+        vm.deref(reference);
+        vm.protect(Invocation::run, &call, 1);
+        return call.result();
+    }
+};
+
 } // namespace util;
 
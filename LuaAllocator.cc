@@ -0,0 +1,135 @@
+#include <LuaAllocator.hh>
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+using namespace util;
+
+static size_t size_class(const size_t size) {
+    return (size - 1) / LuaAllocator::granularity;
+}
+
+static bool pooled(const size_t size) {
+    return size <= LuaAllocator::max_pooled;
+}
+
+LuaAllocator::LuaAllocator(const size_t limit):
+    cursor(nullptr),
+    remaining(0),
+    cap(limit)
+{
+    memset(free_lists, 0, sizeof(free_lists));
+    memset(&stats, 0, sizeof(stats));
+}
+
+LuaAllocator::~LuaAllocator() {
+    for (auto arena : arenas)
+        free(arena);
+    for (auto block : adopted)
+        free(block);
+}
+
+void * LuaAllocator::acquire(const size_t size) {
+    if (!pooled(size))
+        return malloc(size);
+
+    auto c = size_class(size);
+    if (free_lists[c]) {
+        auto block = free_lists[c];
+        free_lists[c] = block->next;
+        return block;
+    }
+
+    auto rounded = (c + 1) * granularity;
+    if (remaining < rounded) {
+        auto arena = (char *)malloc(arena_size);
+        if (!arena)
+            return nullptr;
+        arenas.push_back(arena);
+        cursor = arena;
+        remaining = arena_size;
+    }
+    auto block = cursor;
+    cursor += rounded;
+    remaining -= rounded;
+    return block;
+}
+
+void LuaAllocator::release(void *block, const size_t size) {
+    if (!pooled(size)) {
+        free(block);
+        return;
+    }
+    auto c = size_class(size);
+    auto b = (Block *)block;
+    b->next = free_lists[c];
+    free_lists[c] = b;
+}
+
+void * LuaAllocator::allocate(void *data, void *block, size_t osize,
+    size_t nsize) {
+    auto self = (LuaAllocator *)data;
+    if (!block)
+        osize = 0;
+
+    if (!nsize) {
+        if (block) {
+            self->release(block, osize);
+            self->stats.live -= osize;
+        }
+        return nullptr;
+    }
+
+    if (nsize > osize && self->cap && self->stats.live - osize + nsize > self->cap)
+        return nullptr;
+
+    void *result;
+    if (!block) {
+        result = self->acquire(nsize);
+    } else if (pooled(osize) && pooled(nsize)
+        && size_class(osize) == size_class(nsize)) {
+        result = block;
+    } else if (!pooled(osize) && !pooled(nsize)) {
+        result = realloc(block, nsize);
+        if (!result && nsize < osize)
+            result = block;
+    } else {
+        result = self->acquire(nsize);
+        if (result) {
+            memcpy(result, block, osize < nsize ? osize : nsize);
+            self->release(block, osize);
+        } else if (nsize < osize) {
+            // Lua requires shrinking to succeed: keep the block, which now
+            // serves nsize's class. A malloc'd one must still be freed.
+            if (!pooled(osize)) {
+                try {
+                    self->adopted.push_back(block);
+                } catch (const std::bad_alloc&) {
+                    /* out of memory: leak it rather than fail */
+                }
+            }
+            result = block;
+        }
+    }
+    if (!result)
+        return nullptr;
+
+    self->stats.live += nsize - osize;
+    if (self->stats.live > self->stats.peak)
+        self->stats.peak = self->stats.live;
+    self->stats.allocations++;
+    return result;
+}
+
+void LuaAllocator::limit(const size_t limit) {
+    cap = limit;
+}
+
+size_t LuaAllocator::limit() const {
+    return cap;
+}
+
+LuaAllocator::Statistics LuaAllocator::statistics() const {
+    return stats;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+};
+
+namespace util {
+
+/*
+ * Size-class pool allocator for a single Lua state (see Lua(LuaAllocator&)).
+ *
+ * Blocks up to max_pooled bytes -- strings, tables, closures, upvalues,
+ * which make up most of Lua's allocation churn -- are carved from 64KB
+ * arenas and recycled through per-class free lists; larger blocks go to
+ * malloc. Lua passes the old block size on every call, so pooled blocks
+ * carry no header.
+ *
+ * The allocator also keeps per-state statistics and can enforce a hard
+ * memory limit: allocations that would exceed it fail and Lua raises a
+ * memory error. Like the state it serves it is not thread-safe, and it
+ * must outlive the state.
+ */
+class LuaAllocator {
+public:
+    struct Statistics {
+        size_t live;
+        size_t peak;
+        size_t allocations;
+    };
+
+    static const size_t granularity = 16;
+    static const size_t max_pooled = 256;
+    static const size_t arena_size = 64 * 1024;
+
+private:
+    struct Block {
+        Block *next;
+    };
+
+    Block *free_lists[max_pooled / granularity];
+    std::vector<void *> arenas;
+    /* malloc'd blocks kept to serve a pooled size; freed with the arenas. */
+    std::vector<void *> adopted;
+    char *cursor;
+    size_t remaining;
+    size_t cap;
+    Statistics stats;
+
+    void * acquire(const size_t size);
+    void release(void *block, const size_t size);
+public:
+    LuaAllocator(const size_t limit = 0);
+    ~LuaAllocator();
+
+    LuaAllocator(const LuaAllocator&) = delete;
+    LuaAllocator& operator=(const LuaAllocator&) = delete;
+
+    static void * allocate(void *data, void *block, size_t osize, size_t nsize);
+
+    void limit(const size_t limit);
+    size_t limit() const;
+
+    Statistics statistics() const;
+};
+
+} // namespace util;
@@ -0,0 +1,407 @@
+#include <LuaArray.hh>
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+};
+
+using namespace util;
+
+namespace {
+
+/*
+ * Userdata layout: the view, followed by the elements when Lua owns them.
+ */
+template <typename T>
+struct Header {
+    T *data;
+    size_t size;
+};
+
+/* Largest element count whose userdata size does not overflow. */
+template <typename T>
+size_t max_size() {
+    return (SIZE_MAX - sizeof(Header<T>)) / sizeof(T);
+}
+
+/*
+ * Kernels are plain loops over restrict pointers so the compiler can
+ * vectorize them. Reductions keep four independent accumulators: without
+ * them floating point reassociation rules force a serial dependency chain.
+ */
+template <typename T>
+struct Kernels {
+    typedef typename std::conditional<std::is_floating_point<T>::value,
+        double, long long>::type Accumulator;
+
+    static Accumulator sum(const T * __restrict a, const size_t n) {
+        Accumulator s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            s0 += a[i];
+            s1 += a[i + 1];
+            s2 += a[i + 2];
+            s3 += a[i + 3];
+        }
+        for (; i < n; i++)
+            s0 += a[i];
+        return (s0 + s1) + (s2 + s3);
+    }
+
+    static Accumulator dot(const T * __restrict a, const T * __restrict b,
+        const size_t n) {
+        Accumulator s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            s0 += (Accumulator)a[i] * b[i];
+            s1 += (Accumulator)a[i + 1] * b[i + 1];
+            s2 += (Accumulator)a[i + 2] * b[i + 2];
+            s3 += (Accumulator)a[i + 3] * b[i + 3];
+        }
+        for (; i < n; i++)
+            s0 += (Accumulator)a[i] * b[i];
+        return (s0 + s1) + (s2 + s3);
+    }
+
+    static T min(const T * __restrict a, const size_t n) {
+        T m = a[0];
+        for (size_t i = 1; i < n; i++)
+            m = a[i] < m ? a[i] : m;
+        return m;
+    }
+
+    static T max(const T * __restrict a, const size_t n) {
+        T m = a[0];
+        for (size_t i = 1; i < n; i++)
+            m = a[i] > m ? a[i] : m;
+        return m;
+    }
+
+    static void fill(T * __restrict a, const T x, const size_t n) {
+        for (size_t i = 0; i < n; i++)
+            a[i] = x;
+    }
+
+    static void scale(T * __restrict a, const T x, const size_t n) {
+        for (size_t i = 0; i < n; i++)
+            a[i] *= x;
+    }
+
+    static void axpy(T * __restrict a, const T x, const T * __restrict b,
+        const size_t n) {
+        for (size_t i = 0; i < n; i++)
+            a[i] += x * b[i];
+    }
+
+    static void add(T * __restrict a, const T * __restrict b, const size_t n) {
+        for (size_t i = 0; i < n; i++)
+            a[i] += b[i];
+    }
+
+    static void sub(T * __restrict a, const T * __restrict b, const size_t n) {
+        for (size_t i = 0; i < n; i++)
+            a[i] -= b[i];
+    }
+
+    static void mul(T * __restrict a, const T * __restrict b, const size_t n) {
+        for (size_t i = 0; i < n; i++)
+            a[i] *= b[i];
+    }
+
+    static void div(T * __restrict a, const T * __restrict b, const size_t n) {
+        for (size_t i = 0; i < n; i++)
+            a[i] /= b[i];
+    }
+};
+
+template <typename T>
+struct Methods {
+    /*
+     * Pushes the weak-valued table of Lua-owned arrays keyed by data
+     * address, through which views of them find their owner.
+     */
+    static void owners(lua_State *vm) {
+        static const char key = 0;
+        lua_pushlightuserdata(vm, const_cast<char *>(&key));
+        lua_rawget(vm, LUA_REGISTRYINDEX);
+        if (lua_istable(vm, -1))
+            return;
+        lua_pop(vm, 1);
+        lua_newtable(vm);
+        lua_createtable(vm, 0, 1);
+        lua_pushliteral(vm, "v");
+        lua_setfield(vm, -2, "__mode");
+        lua_setmetatable(vm, -2);
+        lua_pushlightuserdata(vm, const_cast<char *>(&key));
+        lua_pushvalue(vm, -2);
+        lua_rawset(vm, LUA_REGISTRYINDEX);
+    }
+
+    static Header<T> * self(lua_State *vm, const int i = 1) {
+        return (Header<T> *)luaL_checkudata(vm, i, LuaArray<T>::type_name());
+    }
+
+    template <typename V>
+    static void push(lua_State *vm, const V v) {
+        if (std::is_integral<V>::value)
+            lua_pushinteger(vm, (lua_Integer)v);
+        else
+            lua_pushnumber(vm, (lua_Number)v);
+    }
+
+    static T value(lua_State *vm, const int i) {
+        if (std::is_integral<T>::value)
+            return (T)luaL_checkinteger(vm, i);
+        return (T)luaL_checknumber(vm, i);
+    }
+
+    /* Second operand of a binary kernel; it may not alias the first. */
+    static Header<T> * operand(lua_State *vm, const int i, Header<T> *a) {
+        auto b = self(vm, i);
+        if (b->size != a->size)
+            luaL_error(vm, "%s size mismatch (%d and %d)!",
+                LuaArray<T>::type_name(), (int)a->size, (int)b->size);
+        if (b->data == a->data && a->size)
+            luaL_error(vm, "%s operands must not alias!",
+                LuaArray<T>::type_name());
+        return b;
+    }
+
+    static int index(lua_State *vm) {
+        auto a = self(vm);
+        if (lua_type(vm, 2) == LUA_TNUMBER) {
+            lua_Number k = lua_tonumber(vm, 2);
+            if (k >= 1 && k <= a->size && k == (size_t)k)
+                push(vm, a->data[(size_t)k - 1]);
+            else
+                lua_pushnil(vm);
+            return 1;
+        }
+        lua_pushvalue(vm, 2);
+        lua_rawget(vm, lua_upvalueindex(1));
+        return 1;
+    }
+
+    static int newindex(lua_State *vm) {
+        auto a = self(vm);
+        lua_Number k = luaL_checknumber(vm, 2);
+        if (k < 1 || k > a->size || k != (size_t)k)
+            luaL_error(vm, "%s index %f out of range!",
+                LuaArray<T>::type_name(), k);
+        a->data[(size_t)k - 1] = value(vm, 3);
+        return 0;
+    }
+
+    static int length(lua_State *vm) {
+        push(vm, self(vm)->size);
+        return 1;
+    }
+
+    static int tostring(lua_State *vm) {
+        auto a = self(vm);
+        lua_pushfstring(vm, "%s: %p (%d)", LuaArray<T>::type_name(),
+            (void *)a->data, (int)a->size);
+        return 1;
+    }
+
+    static int sum(lua_State *vm) {
+        auto a = self(vm);
+        push(vm, Kernels<T>::sum(a->data, a->size));
+        return 1;
+    }
+
+    static int dot(lua_State *vm) {
+        auto a = self(vm);
+        auto b = self(vm, 2);
+        if (b->size != a->size)
+            luaL_error(vm, "%s size mismatch (%d and %d)!",
+                LuaArray<T>::type_name(), (int)a->size, (int)b->size);
+        push(vm, Kernels<T>::dot(a->data, b->data, a->size));
+        return 1;
+    }
+
+    static int min(lua_State *vm) {
+        auto a = self(vm);
+        if (!a->size)
+            return 0;
+        push(vm, Kernels<T>::min(a->data, a->size));
+        return 1;
+    }
+
+    static int max(lua_State *vm) {
+        auto a = self(vm);
+        if (!a->size)
+            return 0;
+        push(vm, Kernels<T>::max(a->data, a->size));
+        return 1;
+    }
+
+    static int fill(lua_State *vm) {
+        auto a = self(vm);
+        Kernels<T>::fill(a->data, value(vm, 2), a->size);
+        lua_settop(vm, 1);
+        return 1;
+    }
+
+    static int scale(lua_State *vm) {
+        auto a = self(vm);
+        Kernels<T>::scale(a->data, value(vm, 2), a->size);
+        lua_settop(vm, 1);
+        return 1;
+    }
+
+    static int axpy(lua_State *vm) {
+        auto a = self(vm);
+        T x = value(vm, 2);
+        auto b = operand(vm, 3, a);
+        Kernels<T>::axpy(a->data, x, b->data, a->size);
+        lua_settop(vm, 1);
+        return 1;
+    }
+
+    template <void (*kernel)(T *, const T *, const size_t)>
+    static int elementwise(lua_State *vm) {
+        auto a = self(vm);
+        auto b = operand(vm, 2, a);
+        kernel(a->data, b->data, a->size);
+        lua_settop(vm, 1);
+        return 1;
+    }
+
+    static int create(lua_State *vm) {
+        lua_Number n = luaL_checknumber(vm, 1);
+        if (n < 0 || n > (lua_Number)max_size<T>() || n != (size_t)n)
+            luaL_error(vm, "Invalid %s size!", LuaArray<T>::type_name());
+        Lua l(vm);
+        LuaArray<T>::create(l, (size_t)n);
+        return 1;
+    }
+
+    /* Pushes the shared metatable, building it on first use. */
+    static void metatable(lua_State *vm) {
+        if (!luaL_newmetatable(vm, LuaArray<T>::type_name()))
+            return;
+
+        static const luaL_Reg methods[] = {
+            { "sum", sum },
+            { "dot", dot },
+            { "min", min },
+            { "max", max },
+            { "fill", fill },
+            { "scale", scale },
+            { "axpy", axpy },
+            { "add", elementwise<Kernels<T>::add> },
+            { "sub", elementwise<Kernels<T>::sub> },
+            { "mul", elementwise<Kernels<T>::mul> },
+            { "div", elementwise<Kernels<T>::div> },
+            { nullptr, nullptr }
+        };
+        lua_newtable(vm);
+        for (auto method = methods; method->name; method++) {
+            lua_pushcfunction(vm, method->func);
+            lua_setfield(vm, -2, method->name);
+        }
+        lua_pushcclosure(vm, index, 1);
+        lua_setfield(vm, -2, "__index");
+        lua_pushcfunction(vm, newindex);
+        lua_setfield(vm, -2, "__newindex");
+        lua_pushcfunction(vm, length);
+        lua_setfield(vm, -2, "__len");
+        lua_pushcfunction(vm, tostring);
+        lua_setfield(vm, -2, "__tostring");
+    }
+};
+
+}
+
+template <> const char * LuaArray<float>::type_name() {
+    return "LuaArray<float>";
+}
+
+template <> const char * LuaArray<double>::type_name() {
+    return "LuaArray<double>";
+}
+
+template <> const char * LuaArray<int32_t>::type_name() {
+    return "LuaArray<int32_t>";
+}
+
+template <> const char * LuaArray<int64_t>::type_name() {
+    return "LuaArray<int64_t>";
+}
+
+template <typename T>
+void LuaArray<T>::export_me(Lua& vm, const std::string& name) {
+    vm.table();
+    lua_pushcfunction(vm.state(), Methods<T>::create);
+    vm.save("new");
+    lua_setglobal(vm.state(), name.c_str());
+}
+
+template <typename T>
+LuaArray<T> LuaArray<T>::create(Lua& vm, const size_t size) {
+    auto state = vm.state();
+    if (size > max_size<T>())
+        luaL_error(state, "Invalid %s size!", type_name());
+    auto header = (Header<T> *)lua_newuserdata(state,
+        sizeof(Header<T>) + size * sizeof(T));
+    header->data = (T *)(header + 1);
+    header->size = size;
+    memset(header->data, 0, size * sizeof(T));
+    Methods<T>::metatable(state);
+    lua_setmetatable(state, -2);
+    if (size) {
+        Methods<T>::owners(state);
+        lua_pushlightuserdata(state, header->data);
+        lua_pushvalue(state, -3);
+        lua_rawset(state, -3);
+        lua_pop(state, 1);
+    }
+    return LuaArray(header->data, size);
+}
+
+template <typename T>
+void LuaArray<T>::push(Lua& vm, const LuaArray& array) {
+    auto state = vm.state();
+    Methods<T>::owners(state);
+    lua_pushlightuserdata(state, array.items);
+    lua_rawget(state, -2);
+    lua_remove(state, -2);
+    int owner = lua_gettop(state);
+    if (!lua_isnil(state, owner)
+        && ((Header<T> *)lua_touserdata(state, owner))->size == array.count)
+        return;
+
+    auto header = (Header<T> *)lua_newuserdata(state, sizeof(Header<T>));
+    header->data = array.items;
+    header->size = array.count;
+    Methods<T>::metatable(state);
+    lua_setmetatable(state, -2);
+    if (!lua_isnil(state, owner)) {
+        // A shorter view of a Lua-owned array keeps the array alive.
+        lua_createtable(state, 1, 0);
+        lua_pushvalue(state, owner);
+        lua_rawseti(state, -2, 1);
+#if LUA_VERSION_NUM >= 502
+        lua_setuservalue(state, -2);
+#else
+        lua_setfenv(state, -2);
+#endif
+    }
+    lua_remove(state, owner);
+}
+
+template <typename T>
+LuaArray<T> LuaArray<T>::check(Lua& vm, const int i) {
+    auto header = Methods<T>::self(vm.state(), vm.absolute(i));
+    return LuaArray(header->data, header->size);
+}
+
+template class util::LuaArray<float>;
+template class util::LuaArray<double>;
+template class util::LuaArray<int32_t>;
+template class util::LuaArray<int64_t>;
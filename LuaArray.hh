@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Lua.hh>
+
+namespace util {
+
+/*
+ * Typed view of a contiguous numeric buffer, exposed to Lua as userdata.
+ *
+ * Arrays are either owned by Lua (create(), or Name.new(n) from scripts)
+ * or borrow a C++ buffer (push()); a borrowed buffer must outlive every
+ * Lua reference to it. Pushing a view that starts at a Lua-owned array's
+ * data pushes that array again, or a view that keeps it alive. Scripts index them 1-based like tables, take #a,
+ * and call bulk kernels that run over the whole buffer in C++:
+ *
+ *     a:sum()  a:min()  a:max()  a:dot(b)
+ *     a:fill(x)  a:scale(x)  a:axpy(x, b)      -- a = a + x * b
+ *     a:add(b)  a:sub(b)  a:mul(b)  a:div(b)   -- elementwise, in place
+ *
+ * In-place kernels return the array. Instantiated for float, double,
+ * int32_t and int64_t.
+ */
+template <typename T>
+class LuaArray {
+private:
+    T *items;
+    size_t count;
+public:
+    LuaArray(): items(nullptr), count(0) {}
+    LuaArray(T *data, const size_t size): items(data), count(size) {}
+    LuaArray(std::vector<T>& v): items(v.data()), count(v.size()) {}
+
+    T * data() const {
+        return items;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    T& operator[](const size_t i) const {
+        return items[i];
+    }
+
+    static const char * type_name();
+
+    /* Global table name with new(n) creating zeroed, Lua-owned arrays. */
+    static void export_me(Lua& vm, const std::string& name);
+
+    /* Pushes a new Lua-owned array of size zeroed elements. */
+    static LuaArray create(Lua& vm, const size_t size);
+    /* Pushes a userdata for the view's buffer. */
+    static void push(Lua& vm, const LuaArray& array);
+    static LuaArray check(Lua& vm, const int i);
+};
+
+template <> const char * LuaArray<float>::type_name();
+template <> const char * LuaArray<double>::type_name();
+template <> const char * LuaArray<int32_t>::type_name();
+template <> const char * LuaArray<int64_t>::type_name();
+
+extern template class LuaArray<float>;
+extern template class LuaArray<double>;
+extern template class LuaArray<int32_t>;
+extern template class LuaArray<int64_t>;
+
+/* Bindings take and return arrays as views, without copying. */
+template <typename T> struct Lua::marshal<LuaArray<T>> {
+    static int ret(Lua& vm, const LuaArray<T>& r) {
+        LuaArray<T>::push(vm, r);
+        return 1;
+    }
+
+    static LuaArray<T> arg(Lua& vm, const int i) {
+        return LuaArray<T>::check(vm, i);
+    }
+};
+
+} // namespace util;
@@ -0,0 +1,121 @@
+#include <LuaExecutor.hh>
+
+using namespace util;
+
+LuaExecutor::LuaExecutor(const Setup& setup, size_t threads):
+    next(0),
+    parked(0),
+    stopping(false)
+{
+    if (!threads)
+        threads = 1;
+
+    for (size_t i = 0; i < threads; i++) {
+        std::unique_ptr<Worker> worker(new Worker);
+        worker->state.reset(new Lua());
+        worker->parked = false;
+        worker->signalled = false;
+        setup(*worker->state);
+        workers.push_back(std::move(worker));
+    }
+
+    for (size_t i = 0; i < threads; i++)
+        workers[i]->thread = std::thread(&LuaExecutor::run, this, i);
+}
+
+LuaExecutor::~LuaExecutor() {
+    stopping = true;
+    for (auto& worker : workers) {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->wake.notify_one();
+    }
+
+    for (auto& worker : workers)
+        worker->thread.join();
+}
+
+void LuaExecutor::submit(Job job) {
+    auto& worker = *workers[next++ % workers.size()];
+    bool idle;
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.jobs.push_back(std::move(job));
+        idle = worker.parked;
+    }
+    if (idle)
+        worker.wake.notify_one();
+    else
+        steal(worker);
+}
+
+/* Wakes one parked worker, if any, to steal from busy's queue. */
+void LuaExecutor::steal(const Worker& busy) {
+    if (!parked.load(std::memory_order_relaxed))
+        return;
+    for (auto& worker : workers) {
+        if (worker.get() == &busy)
+            continue;
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        if (worker->parked && !worker->signalled) {
+            worker->signalled = true;
+            worker->wake.notify_one();
+            return;
+        }
+    }
+}
+
+bool LuaExecutor::take(const size_t index, Job& job) {
+    {
+        auto& own = *workers[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.jobs.empty()) {
+            job = std::move(own.jobs.front());
+            own.jobs.pop_front();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < workers.size(); i++) {
+        auto& victim = *workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.jobs.empty()) {
+            job = std::move(victim.jobs.back());
+            victim.jobs.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void LuaExecutor::run(const size_t index) {
+    auto& self = *workers[index];
+    auto& vm = *self.state;
+
+    for (;;) {
+        Job job;
+        if (take(index, job)) {
+            job(vm);
+            lua_settop(vm.state(), 0);
+            continue;
+        }
+        // Every queue is drained by its owner, so stopping once ours is
+        // empty loses no job.
+        if (stopping)
+            return;
+
+        std::unique_lock<std::mutex> lock(self.mutex);
+        self.parked = true;
+        parked++;
+        self.wake.wait(lock, [this, &self] {
+            return !self.jobs.empty() || self.signalled || stopping;
+        });
+        self.parked = false;
+        self.signalled = false;
+        parked--;
+    }
+}
+
+size_t LuaExecutor::size() const {
+    return workers.size();
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Lua.hh>
+
+namespace util {
+
+/*
+ * Runs script calls on a fixed set of worker threads, each owning its own
+ * Lua state. Every state is set up by the same function before the workers
+ * start, so bindings and loaded scripts are identical across them.
+ *
+ * Jobs are spread round-robin over per-worker queues; a worker takes from
+ * the front of its own queue and, when that is empty, steals from the back
+ * of the others. There is no executor-wide lock: a worker with nothing to
+ * do parks on its own condition variable, and submit() wakes the queue's
+ * owner or, when that one is busy, a parked worker that can steal the job.
+ * Results come back as futures; a Lua error becomes the future's
+ * exception.
+ */
+class LuaExecutor {
+public:
+    typedef std::function<void(Lua&)> Setup;
+    typedef std::function<void(Lua&)> Job;
+
+private:
+    struct Worker {
+        std::unique_ptr<Lua> state;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<Job> jobs;
+        bool parked;
+        bool signalled;
+        std::thread thread;
+    };
+
+    template <typename R> struct fulfil {
+        template <typename... Args>
+        static void call(std::promise<R>& promise, Lua& vm,
+            const std::string& name, const std::tuple<Args...>& args) {
+            promise.set_value(vm.apply<R>(name, args));
+        }
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> next;
+    std::atomic<size_t> parked;
+    std::atomic<bool> stopping;
+
+    bool take(const size_t index, Job& job);
+    void steal(const Worker& busy);
+    void run(const size_t index);
+public:
+    explicit LuaExecutor(const Setup& setup,
+        size_t threads = std::thread::hardware_concurrency());
+    ~LuaExecutor();
+
+    LuaExecutor(const LuaExecutor&) = delete;
+    LuaExecutor& operator=(const LuaExecutor&) = delete;
+
+    void submit(Job job);
+
+    /* Calls the global function name with copies of args on some worker. */
+    template <typename R, typename... Args>
+    std::future<R> call(const std::string& name, const Args&... args) {
+        typedef std::tuple<typename std::decay<Args>::type...> Arguments;
+        auto promise = std::make_shared<std::promise<R>>();
+        auto arguments = std::make_shared<Arguments>(args...);
+        auto result = promise->get_future();
+        submit([promise, arguments, name] (Lua& vm) {
+            try {
+                fulfil<R>::call(*promise, vm, name, *arguments);
+            } catch (...) {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        return result;
+    }
+
+    size_t size() const;
+};
+
+template <> struct LuaExecutor::fulfil<void> {
+    template <typename... Args>
+    static void call(std::promise<void>& promise, Lua& vm,
+        const std::string& name, const std::tuple<Args...>& args) {
+        vm.apply<void>(name, args);
+        promise.set_value();
+    }
+};
+
+} // namespace util;
@@ -0,0 +1,230 @@
+#include <LuaLoop.hh>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+};
+
+using namespace util;
+
+#if LUA_VERSION_NUM >= 504
+static int resume_thread(lua_State *thread, lua_State *from, const int n) {
+    int results;
+    return lua_resume(thread, from, n, &results);
+}
+#elif LUA_VERSION_NUM >= 502
+static int resume_thread(lua_State *thread, lua_State *from, const int n) {
+    return lua_resume(thread, from, n);
+}
+#else
+static int resume_thread(lua_State *thread, lua_State *, const int n) {
+    return lua_resume(thread, n);
+}
+#endif
+
+LuaCompletion::LuaCompletion():
+    done(false),
+    error(false),
+    loop(nullptr)
+{}
+
+void LuaCompletion::complete(const bool failed, const std::string& text) {
+    LuaLoop *target;
+    std::function<void()> next;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (done)
+            return;
+        done = true;
+        error = failed;
+        message = text;
+        target = loop;
+        next.swap(continuation);
+    }
+    if (target)
+        target->post(next);
+}
+
+void LuaCompletion::then(LuaLoop *target,
+    const std::function<void()>& next) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!done) {
+            loop = target;
+            continuation = next;
+            return;
+        }
+    }
+    target->post(next);
+}
+
+bool LuaCompletion::ready() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return done;
+}
+
+bool LuaCompletion::failed() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return error;
+}
+
+std::string LuaCompletion::error_message() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return message;
+}
+
+LuaLoop::LuaLoop():
+    poll(epoll_create1(EPOLL_CLOEXEC)),
+    wakeup(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+    stopped(false)
+{
+    if (poll < 0 || wakeup < 0) {
+        std::string error = strerror(errno);
+        if (poll >= 0)
+            close(poll);
+        if (wakeup >= 0)
+            close(wakeup);
+        throw std::runtime_error("LuaLoop: " + error);
+    }
+
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wakeup;
+    epoll_ctl(poll, EPOLL_CTL_ADD, wakeup, &event);
+}
+
+LuaLoop::~LuaLoop() {
+    for (auto& task : tasks)
+        luaL_unref(task.second.main, LUA_REGISTRYINDEX, task.second.ref);
+    close(wakeup);
+    close(poll);
+}
+
+void LuaLoop::post(const std::function<void()>& function) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        posted.push_back(function);
+    }
+    uint64_t one = 1;
+    if (write(wakeup, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        throw std::runtime_error(std::string("LuaLoop: ") + strerror(errno));
+}
+
+void LuaLoop::watch(const int fd, const uint32_t events,
+    const Watcher& watcher) {
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    int operation = watchers.count(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(poll, operation, fd, &event) < 0)
+        throw std::runtime_error(std::string("LuaLoop: ") + strerror(errno));
+    watchers[fd] = watcher;
+}
+
+void LuaLoop::unwatch(const int fd) {
+    if (watchers.erase(fd))
+        epoll_ctl(poll, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void LuaLoop::drain() {
+    uint64_t count;
+    while (read(wakeup, &count, sizeof(count)) > 0);
+
+    std::vector<std::function<void()>> functions;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        functions.swap(posted);
+    }
+    for (auto& function : functions)
+        function();
+}
+
+void LuaLoop::run() {
+    stopped = false;
+    epoll_event events[64];
+
+    for (;;) {
+        drain();
+        if (stopped || !pending())
+            return;
+
+        int n = epoll_wait(poll, events, 64, -1);
+        if (n < 0 && errno != EINTR)
+            throw std::runtime_error(std::string("LuaLoop: ")
+                + strerror(errno));
+
+        for (int i = 0; i < n; i++) {
+            auto watcher = watchers.find(events[i].data.fd);
+            if (watcher == watchers.end())
+                continue;
+            // The watcher may unwatch its own descriptor.
+            Watcher call = watcher->second;
+            call(events[i].events);
+        }
+    }
+}
+
+void LuaLoop::stop() {
+    post([this] { stopped = true; });
+}
+
+size_t LuaLoop::pending() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return tasks.size() + watchers.size() + posted.size();
+}
+
+int LuaLoop::fail(Lua& vm, LuaCompletion& completion) {
+    lua_pushnil(vm.state());
+    vm.string(completion.error_message());
+    return 2;
+}
+
+lua_State * LuaLoop::suspend(Lua& vm) {
+    if (!tasks.count(vm.state()))
+        luaL_error(vm.state(), "asynchronous call outside of a LuaLoop task");
+    return vm.state();
+}
+
+lua_State * LuaLoop::start(Lua& vm,
+    const std::function<void(Lua&, const char *)>& done) {
+    lua_State *thread = lua_newthread(vm.state());
+    Task task = { luaL_ref(vm.state(), LUA_REGISTRYINDEX), vm.state(), done };
+    tasks[thread] = task;
+    return thread;
+}
+
+void LuaLoop::resume(lua_State *thread, const int n) {
+    auto found = tasks.find(thread);
+    if (found == tasks.end())
+        return;
+
+    int status = resume_thread(thread, found->second.main, n);
+    if (status == LUA_YIELD)
+        return;
+
+    Task task = found->second;
+    tasks.erase(found);
+
+    Lua vm(task.main);
+    if (status) {
+        const char *message = lua_tostring(thread, -1);
+        task.done(vm, message ? message : "(error object is not a string)");
+    } else {
+        if (lua_gettop(thread) > 0) {
+            lua_pushvalue(thread, 1);
+            lua_xmove(thread, task.main, 1);
+        } else {
+            lua_pushnil(task.main);
+        }
+        task.done(vm, nullptr);
+    }
+    luaL_unref(task.main, LUA_REGISTRYINDEX, task.ref);
+}
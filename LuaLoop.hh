@@ -0,0 +1,261 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <Lua.hh>
+
+namespace util {
+
+/*
+ * Completion state shared by the two ends of a LuaFuture. Whoever produces
+ * the result completes it from any thread; the continuation registered by
+ * the loop is then posted back to the loop thread.
+ */
+class LuaCompletion {
+private:
+    std::mutex mutex;
+    bool done;
+    bool error;
+    std::string message;
+    LuaLoop *loop;
+    std::function<void()> continuation;
+public:
+    LuaCompletion();
+
+    void complete(const bool failed, const std::string& message);
+    void then(LuaLoop *loop, const std::function<void()>& continuation);
+
+    bool ready();
+    bool failed();
+    std::string error_message();
+};
+
+/*
+ * Result of an asynchronous binding. The binding returns it right away and
+ * keeps a copy to call set_value() or set_error() once the work is done;
+ * until then the calling coroutine stays suspended.
+ */
+template <typename R>
+class LuaFuture {
+private:
+    struct State : public LuaCompletion {
+        R value;
+    };
+
+    std::shared_ptr<State> state;
+public:
+    LuaFuture(): state(std::make_shared<State>()) {}
+
+    void set_value(const R& value) {
+        state->value = value;
+        state->complete(false, std::string());
+    }
+
+    void set_error(const std::string& message) {
+        state->complete(true, message);
+    }
+
+    const R& value() const {
+        return state->value;
+    }
+
+    LuaCompletion& completion() const {
+        return *state;
+    }
+};
+
+template <>
+class LuaFuture<void> {
+private:
+    std::shared_ptr<LuaCompletion> state;
+public:
+    LuaFuture(): state(std::make_shared<LuaCompletion>()) {}
+
+    void set_value() {
+        state->complete(false, std::string());
+    }
+
+    void set_error(const std::string& message) {
+        state->complete(true, message);
+    }
+
+    LuaCompletion& completion() const {
+        return *state;
+    }
+};
+
+/*
+ * Single-threaded epoll event loop that runs Lua functions as coroutines.
+ *
+ * Functions exported with export_function() return a LuaFuture; when the
+ * future is not ready yet the calling coroutine yields and is resumed on
+ * the loop thread with the value once it is, so one state can have many
+ * calls in flight. A failed future resumes the caller with nil and the
+ * error message. Asynchronous bindings may only be called from tasks
+ * started with spawn().
+ *
+ * Everything except post() and completing futures must happen on the
+ * thread that calls run().
+ */
+class LuaLoop {
+public:
+    typedef std::function<void(uint32_t)> Watcher;
+
+private:
+    struct Task {
+        int ref;
+        lua_State *main;
+        std::function<void(Lua&, const char *)> done;
+    };
+
+    template <typename R, typename... Args>
+    struct async_binding {
+        typedef LuaFuture<R> (*Function)(Args...);
+
+        static int call(lua_State *state) {
+            int results;
+            {
+                Lua vm(state);
+                auto function = *(Function *)vm.upvalue();
+                auto loop = (LuaLoop *)vm.upvalue(2);
+                auto tuple = vm.args<typename std::decay<Args>::type...>();
+                results = loop->await(vm, Lua::apply_function<sizeof...(Args)>::
+                    apply(function, tuple));
+            }
+            // On 5.2+ lua_yield longjmps out of this frame: the arguments
+            // and the future must be destroyed before it.
+            return results < 0 ? lua_yield(state, 0) : results;
+        }
+    };
+
+    template <typename R> struct settle {
+        static_assert(Lua::owned_result<R>::value,
+            "Borrowed string results would dangle, use std::string!");
+        static void convert(Lua& vm, void *data) {
+            auto future = (LuaFuture<R> *)data;
+            future->set_value(vm.arg<R>(-1));
+        }
+
+        static void call(Lua& vm, LuaFuture<R>& future) {
+            vm.protect(convert, &future, 1);
+        }
+    };
+
+    int poll;
+    int wakeup;
+    bool stopped;
+
+    mutable std::mutex mutex;
+    std::vector<std::function<void()>> posted;
+
+    std::unordered_map<int, Watcher> watchers;
+    std::unordered_map<lua_State *, Task> tasks;
+
+    template <typename R>
+    static int push(Lua& vm, const LuaFuture<R>& future) {
+        if (future.completion().failed())
+            return fail(vm, future.completion());
+        return vm.ret(future.value());
+    }
+
+    static int push(Lua& vm, const LuaFuture<void>& future) {
+        if (future.completion().failed())
+            return fail(vm, future.completion());
+        return 0;
+    }
+
+    static int fail(Lua& vm, LuaCompletion& completion);
+
+    /*
+     * Pushes the results of a ready future; otherwise resumes the calling
+     * coroutine with them once it completes and returns -1: the caller
+     * must then yield.
+     */
+    template <typename R>
+    int await(Lua& vm, const LuaFuture<R>& future) {
+        if (future.completion().ready())
+            return push(vm, future);
+        lua_State *thread = suspend(vm);
+        future.completion().then(this, [this, thread, future] {
+            Lua co(thread);
+            resume(thread, push(co, future));
+        });
+        return -1;
+    }
+
+    lua_State * suspend(Lua& vm);
+    lua_State * start(Lua& vm,
+        const std::function<void(Lua&, const char *)>& done);
+    void resume(lua_State *thread, const int n);
+    void drain();
+public:
+    LuaLoop();
+    ~LuaLoop();
+
+    LuaLoop(const LuaLoop&) = delete;
+    LuaLoop& operator=(const LuaLoop&) = delete;
+
+    /* Runs function on the loop thread; safe to call from any thread. */
+    void post(const std::function<void()>& function);
+
+    /* Calls watcher with the ready epoll events of fd until unwatch(). */
+    void watch(const int fd, const uint32_t events, const Watcher& watcher);
+    void unwatch(const int fd);
+
+    /* Runs until stop() or until no task, watcher or posted call is left. */
+    void run();
+    void stop();
+
+    size_t pending() const;
+
+    template <typename R, typename... Args>
+    void export_function(Lua& vm, const std::string& name,
+        LuaFuture<R> (*callback)(Args...)) {
+        typedef LuaFuture<R> (*Function)(Args...);
+        *(Function *)lua_newuserdata(vm.state(), sizeof(Function)) = callback;
+        lua_pushlightuserdata(vm.state(), this);
+        vm.closure(async_binding<R, Args...>::call, 2);
+        vm.save(name);
+    }
+
+    /*
+     * Calls the global function name in a new coroutine of vm; the future
+     * completes with its first result or its error.
+     */
+    template <typename R, typename... Args>
+    LuaFuture<R> spawn(Lua& vm, const std::string& name,
+        const Args&... args) {
+        LuaFuture<R> result;
+        lua_State *thread = start(vm, [result] (Lua& vm, const char *error)
+            mutable {
+            if (error)
+                result.set_error(error);
+            else
+                try {
+                    settle<R>::call(vm, result);
+                } catch (const std::runtime_error& e) {
+                    result.set_error(e.what());
+                }
+        });
+        Lua co(thread);
+        co.global(name);
+        resume(thread, Lua::push_arguments<sizeof...(Args)>::push(co,
+            std::tuple<typename std::decay<Args>::type...>(args...)));
+        return result;
+    }
+};
+
+template <> struct LuaLoop::settle<void> {
+    static void call(Lua& vm, LuaFuture<void>& future) {
+        vm.pop();
+        future.set_value();
+    }
+};
+
+} // namespace util;
@@ -0,0 +1,222 @@
+#include <LuaProfiler.hh>
+
+#include <new>
+
+extern "C" {
+#include <lua.h>
+#if defined(LUA_USE_LUAJIT)
+#include <luajit.h>
+#endif
+};
+
+#if defined(LUAJIT_VERSION_NUM) && LUAJIT_VERSION_NUM >= 20100
+#define LUACXX_JIT_PROFILER 1
+#endif
+
+using namespace util;
+
+static const char profiler_key = 0;
+static const char pending_key = 0;
+
+LuaProfiler::LuaProfiler(const Trigger trigger, const unsigned long period,
+    const unsigned depth):
+    trigger(trigger),
+    period(period ? period : 1),
+    depth(depth ? depth : 1),
+    state(nullptr),
+    running(false),
+    requested(nullptr),
+    total(0)
+{}
+
+LuaProfiler::~LuaProfiler() {
+    stop();
+}
+
+void LuaProfiler::start(Lua& vm) {
+    stop();
+    state = vm.state();
+    requested = pending(state);
+    lua_pushlightuserdata(state, const_cast<char *>(&profiler_key));
+    lua_pushlightuserdata(state, this);
+    lua_rawset(state, LUA_REGISTRYINDEX);
+    running = true;
+
+    if (trigger == Count) {
+        lua_sethook(state, hook, LUA_MASKCOUNT, period);
+        return;
+    }
+
+#ifdef LUACXX_JIT_PROFILER
+    auto mode = "i" + std::to_string(period >= 1000 ? period / 1000 : 1);
+    luaJIT_profile_start(state, mode.c_str(), jit_sample, this);
+    return;
+#endif
+
+    timer = std::thread([this] {
+        auto interval = std::chrono::microseconds(period);
+        auto next = std::chrono::steady_clock::now() + interval;
+        while (running) {
+            std::this_thread::sleep_until(next);
+            next += interval;
+            if (running) {
+                requested->store(true);
+                lua_sethook(state, hook, LUA_MASKCOUNT, 1);
+            }
+        }
+    });
+}
+
+void LuaProfiler::stop() {
+    if (!state)
+        return;
+    running = false;
+    if (timer.joinable())
+        timer.join();
+    requested->store(false);
+#ifdef LUACXX_JIT_PROFILER
+    if (trigger == Timer)
+        luaJIT_profile_stop(state);
+#endif
+    lua_sethook(state, nullptr, 0, 0);
+    lua_pushlightuserdata(state, const_cast<char *>(&profiler_key));
+    lua_pushnil(state);
+    lua_rawset(state, LUA_REGISTRYINDEX);
+    state = nullptr;
+}
+
+void LuaProfiler::hook(lua_State *vm, lua_Debug *) {
+    lua_pushlightuserdata(vm, const_cast<char *>(&profiler_key));
+    lua_rawget(vm, LUA_REGISTRYINDEX);
+    auto profiler = (LuaProfiler *)lua_touserdata(vm, -1);
+    lua_pop(vm, 1);
+    if (!profiler)
+        return;
+    if (profiler->trigger == Count) {
+        profiler->record(profiler->stack(vm, nullptr), 1);
+        return;
+    }
+    // One-shot: the request may already have been taken by a binding.
+    lua_sethook(vm, nullptr, 0, 0);
+    if (profiler->requested->exchange(false))
+        profiler->record(profiler->stack(vm, nullptr), 1);
+}
+
+std::atomic<bool> * LuaProfiler::pending(lua_State *vm) {
+    lua_pushlightuserdata(vm, const_cast<char *>(&pending_key));
+    lua_rawget(vm, LUA_REGISTRYINDEX);
+    auto flag = (std::atomic<bool> *)lua_touserdata(vm, -1);
+    lua_pop(vm, 1);
+    if (flag)
+        return flag;
+    lua_pushlightuserdata(vm, const_cast<char *>(&pending_key));
+    flag = new (lua_newuserdata(vm, sizeof(std::atomic<bool>)))
+        std::atomic<bool>(false);
+    lua_rawset(vm, LUA_REGISTRYINDEX);
+    return flag;
+}
+
+void LuaProfiler::binding(lua_State *vm, const char *name) {
+    lua_pushlightuserdata(vm, const_cast<char *>(&profiler_key));
+    lua_rawget(vm, LUA_REGISTRYINDEX);
+    auto profiler = (LuaProfiler *)lua_touserdata(vm, -1);
+    lua_pop(vm, 1);
+    if (profiler && profiler->requested->exchange(false))
+        profiler->record(profiler->stack(vm, name), 1);
+}
+
+/* One frame of a folded stack; ';' separates frames, so it is replaced. */
+static std::string frame(const lua_Debug& ar) {
+    std::string name;
+    if (*ar.what == 'C') {
+        name = std::string(ar.name ? ar.name : "?") + " [C]";
+    } else if (*ar.what == 'm') {
+        name = std::string("main ") + ar.short_src;
+    } else {
+        name = std::string(ar.name ? ar.name : "?") + " " + ar.short_src
+            + ":" + std::to_string(ar.linedefined);
+    }
+    for (auto& c : name)
+        if (c == ';')
+            c = ':';
+    return name;
+}
+
+/* Number of active call levels, probing O(log n) of them. */
+static int levels(lua_State *vm) {
+    lua_Debug ar;
+    if (!lua_getstack(vm, 0, &ar))
+        return 0;
+    int low = 0, high = 1;
+    while (lua_getstack(vm, high, &ar)) {
+        low = high;
+        high *= 2;
+    }
+    while (high - low > 1) {
+        int middle = low + (high - low) / 2;
+        if (lua_getstack(vm, middle, &ar))
+            low = middle;
+        else
+            high = middle;
+    }
+    return high;
+}
+
+/*
+ * Folded call stack, root first; binding names the C function at level 0,
+ * if bound. Deep stacks keep their roots so they still fold together.
+ */
+std::string LuaProfiler::stack(lua_State *vm, const char *binding) {
+    int top = levels(vm);
+    int cut = top > (int)depth ? top - (int)depth : 0;
+    std::string stack;
+    lua_Debug ar;
+    for (int level = top - 1; level >= cut; level--) {
+        lua_getstack(vm, level, &ar);
+        lua_getinfo(vm, "Sn", &ar);
+        if (!level && binding && *ar.what == 'C')
+            ar.name = binding;
+        if (!stack.empty())
+            stack += ';';
+        stack += frame(ar);
+    }
+    if (cut)
+        stack += ";...";
+    return stack;
+}
+
+void LuaProfiler::jit_sample(void *data, lua_State *vm, int samples,
+    int vmstate) {
+#ifdef LUACXX_JIT_PROFILER
+    // The callback runs at the VM's next safe point, after a C function
+    // interrupted by the tick has returned: add an anonymous leaf for it.
+    auto profiler = (LuaProfiler *)data;
+    auto stack = profiler->stack(vm, nullptr);
+    if (vmstate == 'C')
+        stack += stack.empty() ? "? [C]" : ";? [C]";
+    profiler->record(stack, samples);
+#endif
+}
+
+void LuaProfiler::record(const std::string& stack, const unsigned long n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stacks[stack] += n;
+    total += n;
+}
+
+unsigned long LuaProfiler::samples() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total;
+}
+
+void LuaProfiler::folded(std::ostream& out) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& stack : stacks)
+        out << stack.first << " " << stack.second << "\n";
+}
+
+void LuaProfiler::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stacks.clear();
+    total = 0;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#include <Lua.hh>
+
+namespace util {
+
+/*
+ * Sampling profiler for the scripts running in one state.
+ *
+ * Count mode samples every period VM instructions through a count hook,
+ * so it measures interpreted code only: C functions run no instructions.
+ * Timer mode runs a thread that requests a sample and arms a one-shot
+ * hook every period microseconds (lua_sethook may be called
+ * asynchronously), so between samples the state runs without any hook at
+ * all. Hooks only fire between VM instructions, so a request that arrives
+ * while a bound C++ function runs is taken by the binding's dispatcher
+ * when it returns, with the binding ("Class.method [C]") as leaf frame.
+ * Each sample records the outermost depth frames, with a "..." leaf when
+ * the stack was deeper; the aggregated stacks are written in folded format
+ * ("a;b;c 12" per line) for flamegraph tools.
+ *
+ * On LuaJIT 2.1, where hooks do not run inside compiled traces, count
+ * mode is unsupported (it sees little or nothing) and timer mode uses the
+ * VM's own sampling profiler (millisecond resolution) instead. Time in C
+ * functions then shows up as a "? [C]" leaf, and only one state can be
+ * profiled at a time.
+ *
+ * The profiler owns the state's hook while it runs.
+ */
+class LuaProfiler {
+public:
+    enum Trigger {
+        Count,
+        Timer
+    };
+
+private:
+    const Trigger trigger;
+    const unsigned long period;
+    const unsigned depth;
+
+    lua_State *state;
+    std::thread timer;
+    std::atomic<bool> running;
+    std::atomic<bool> *requested;
+
+    mutable std::mutex mutex;
+    std::map<std::string, unsigned long> stacks;
+    unsigned long total;
+
+    static void hook(lua_State *vm, lua_Debug *ar);
+    static void jit_sample(void *data, lua_State *vm, int samples,
+        int vmstate);
+    std::string stack(lua_State *vm, const char *binding);
+    void record(const std::string& stack, const unsigned long n);
+public:
+    LuaProfiler(const Trigger trigger, const unsigned long period,
+        const unsigned depth = 64);
+    ~LuaProfiler();
+
+    LuaProfiler(const LuaProfiler&) = delete;
+    LuaProfiler& operator=(const LuaProfiler&) = delete;
+
+    void start(Lua& vm);
+    void stop();
+
+    unsigned long samples() const;
+    void folded(std::ostream& out) const;
+    void clear();
+
+    /*
+     * The state's pending sample flag, set by the timer thread. Bindings
+     * keep a pointer to it and, when it is set after a call returns, call
+     * binding() to take the sample requested during the call.
+     */
+    static std::atomic<bool> * pending(lua_State *vm);
+    static void binding(lua_State *vm, const char *name);
+};
+
+} // namespace util;
@@ -0,0 +1,214 @@
+#include <LuaStatePool.hh>
+
+extern "C" {
+#include <lua.h>
+};
+
+using namespace util;
+
+/* Pushes a shallow copy of the global table. */
+static void snapshot(Lua& lua) {
+    auto vm = lua.state();
+    lua.globals();
+    lua_newtable(vm);
+    lua_pushnil(vm);
+    while (lua_next(vm, -3)) {
+        lua_pushvalue(vm, -2);
+        lua_insert(vm, -2);
+        lua_rawset(vm, -4);
+    }
+    lua_remove(vm, -2);
+}
+
+/* Makes the global table match the snapshot on top of the stack. */
+static void restore(Lua& lua) {
+    auto vm = lua.state();
+    int saved = lua_gettop(vm);
+    lua.globals();
+    int current = saved + 1;
+    // Clearing fields is allowed while traversing; adding them is not.
+    lua_pushnil(vm);
+    while (lua_next(vm, current)) {
+        lua_pop(vm, 1);
+        lua_pushvalue(vm, -1);
+        lua_rawget(vm, saved);
+        if (lua_isnil(vm, -1)) {
+            lua_pushvalue(vm, -2);
+            lua_pushnil(vm);
+            lua_rawset(vm, current);
+        }
+        lua_pop(vm, 1);
+    }
+    lua_pushnil(vm);
+    while (lua_next(vm, saved)) {
+        lua_pushvalue(vm, -2);
+        lua_rawget(vm, current);
+        if (!lua_rawequal(vm, -1, -2)) {
+            lua_pushvalue(vm, -3);
+            lua_pushvalue(vm, -3);
+            lua_rawset(vm, current);
+        }
+        lua_pop(vm, 2);
+    }
+    lua_settop(vm, saved - 1);
+}
+
+LuaStatePool::LuaStatePool(const size_t minimum, const size_t maximum,
+    const unsigned long uses):
+    minimum(minimum),
+    maximum(maximum < minimum ? minimum : maximum),
+    uses(uses),
+    total(0),
+    counters()
+{}
+
+void LuaStatePool::record(const Step& step) {
+    step(prototype);
+    steps.push_back(step);
+}
+
+void LuaStatePool::file(const std::string& name) {
+    record([name] (Lua& vm) {
+        vm.file(name);
+    });
+}
+
+LuaStatePool::Entry LuaStatePool::create() {
+    Entry entry = { std::unique_ptr<Lua>(new Lua()), 0, 0 };
+    for (auto& step : steps)
+        step(*entry.state);
+    snapshot(*entry.state);
+    entry.globals = entry.state->ref();
+    return entry;
+}
+
+void LuaStatePool::warm() {
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (idle.size() >= minimum || total >= maximum)
+                return;
+            total++;
+        }
+        Entry entry;
+        try {
+            entry = create();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            total--;
+            available.notify_one();
+            throw;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.created++;
+        idle.push_back(std::move(entry));
+        available.notify_one();
+    }
+}
+
+LuaStatePool::Lease LuaStatePool::acquire() {
+    auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex);
+    available.wait(lock, [this] {
+        return !idle.empty() || total < maximum;
+    });
+
+    Entry entry;
+    if (!idle.empty()) {
+        entry = std::move(idle.back());
+        idle.pop_back();
+    } else {
+        total++;
+        lock.unlock();
+        try {
+            entry = create();
+        } catch (...) {
+            lock.lock();
+            total--;
+            available.notify_one();
+            throw;
+        }
+        lock.lock();
+        counters.created++;
+    }
+
+    auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+    counters.acquisitions++;
+    counters.total_wait += wait;
+    if (wait > counters.max_wait)
+        counters.max_wait = wait;
+    return Lease(this, std::move(entry));
+}
+
+void LuaStatePool::release(Entry& entry, const bool discard) {
+    entry.uses++;
+    if (discard || (uses && entry.uses >= uses)) {
+        entry.state.reset();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            total--;
+            counters.recycled++;
+            available.notify_one();
+        }
+        try {
+            warm();
+        } catch (...) {
+            /* acquire() builds the state on demand instead */
+        }
+        return;
+    }
+
+    lua_settop(entry.state->state(), 0);
+    entry.state->deref(entry.globals);
+    restore(*entry.state);
+    std::lock_guard<std::mutex> lock(mutex);
+    idle.push_back(std::move(entry));
+    available.notify_one();
+}
+
+LuaStatePool::Metrics LuaStatePool::metrics() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+size_t LuaStatePool::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total;
+}
+
+size_t LuaStatePool::available_states() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return idle.size();
+}
+
+LuaStatePool::Lease::Lease(LuaStatePool *pool, Entry&& entry):
+    pool(pool),
+    entry(std::move(entry)),
+    discarded(false)
+{}
+
+LuaStatePool::Lease::Lease(Lease&& lease):
+    pool(lease.pool),
+    entry(std::move(lease.entry)),
+    discarded(lease.discarded)
+{
+    lease.pool = nullptr;
+}
+
+LuaStatePool::Lease::~Lease() {
+    if (pool && entry.state)
+        pool->release(entry, discarded);
+}
+
+Lua& LuaStatePool::Lease::operator*() {
+    return *entry.state;
+}
+
+Lua* LuaStatePool::Lease::operator->() {
+    return entry.state.get();
+}
+
+void LuaStatePool::Lease::discard() {
+    discarded = true;
+}
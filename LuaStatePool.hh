@@ -0,0 +1,128 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Lua.hh>
+
+namespace util {
+
+/*
+ * Pool of pre-warmed Lua states.
+ *
+ * Binding registrations and script loads are recorded once: each step is
+ * run against a template state (so mistakes surface immediately) and
+ * replayed into every state the pool creates. States are handed out as
+ * RAII leases; on return the stack is reset, globals a lease added,
+ * removed or reassigned are restored to their values after replay, and
+ * the state goes back to the idle list. The restore is shallow: changes
+ * made inside tables (including library tables and package.loaded) and
+ * registry contents survive, so leases needing full isolation should
+ * discard() the state or use a pool built with uses == 1. A state is
+ * closed and rebuilt when it has served its maximum number of leases or
+ * the lease was discarded.
+ *
+ * Record every step before the first acquire().
+ */
+class LuaStatePool {
+public:
+    typedef std::function<void(Lua&)> Step;
+
+    struct Metrics {
+        unsigned long acquisitions;
+        unsigned long created;
+        unsigned long recycled;
+        std::chrono::nanoseconds total_wait;
+        std::chrono::nanoseconds max_wait;
+    };
+
+private:
+    struct Entry {
+        std::unique_ptr<Lua> state;
+        unsigned long uses;
+        /* Registry reference to a copy of the globals after replay. */
+        int globals;
+    };
+
+    const size_t minimum;
+    const size_t maximum;
+    const unsigned long uses;
+
+    Lua prototype;
+    std::vector<Step> steps;
+
+    mutable std::mutex mutex;
+    std::condition_variable available;
+    std::vector<Entry> idle;
+    size_t total;
+    Metrics counters;
+
+    Entry create();
+    void release(Entry& entry, const bool discard);
+public:
+    class Lease {
+    private:
+        LuaStatePool *pool;
+        Entry entry;
+        bool discarded;
+
+        friend class LuaStatePool;
+        Lease(LuaStatePool *pool, Entry&& entry);
+    public:
+        Lease(Lease&& lease);
+        ~Lease();
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        Lua& operator*();
+        Lua* operator->();
+
+        /* The state is closed instead of being returned to the pool. */
+        void discard();
+    };
+
+    /*
+     * minimum states are kept warm, at most maximum exist at once;
+     * with uses > 0 a state is rebuilt after serving that many leases.
+     */
+    LuaStatePool(const size_t minimum, const size_t maximum,
+        const unsigned long uses = 0);
+
+    LuaStatePool(const LuaStatePool&) = delete;
+    LuaStatePool& operator=(const LuaStatePool&) = delete;
+
+    void record(const Step& step);
+
+    template <typename R, typename... Args>
+    void export_function(const std::string& name, R (*callback)(Args...)) {
+        record([name, callback] (Lua& vm) {
+            vm.export_function(name, callback);
+        });
+    }
+
+    template <class T>
+    void export_class() {
+        record([] (Lua& vm) {
+            T::export_me(vm);
+        });
+    }
+
+    void file(const std::string& name);
+
+    /* Builds states until minimum of them are idle. */
+    void warm();
+
+    Lease acquire();
+
+    Metrics metrics() const;
+    size_t size() const;
+    size_t available_states() const;
+};
+
+} // namespace util;
@@ -0,0 +1,310 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <Lua.hh>
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+};
+
+/*
+ * Binding overhead benchmarks: each case runs the same Lua loop once
+ * against a LuaCxx binding and once against a hand-written lua_CFunction
+ * doing the equivalent work, and reports nanoseconds per iteration as
+ * JSON.
+ *
+ *     LuaCxx_bench [iterations]
+ */
+
+namespace {
+
+void call0() {
+}
+
+int call1(int a) {
+    return a;
+}
+
+int call2(int a, int b) {
+    return a + b;
+}
+
+int call3(int a, int b, int c) {
+    return a + b + c;
+}
+
+double number(double a) {
+    return a * 0.5;
+}
+
+std::string echo(const std::string& s) {
+    return s;
+}
+
+class bench_object : public util::LuaClass {
+public:
+    static void export_me(util::Lua& vm) {
+        vm.export_class<bench_object>();
+    }
+
+    static void export_class(util::Lua& vm) {
+        vm.export_constructor<bench_object>();
+        vm.export_method("get", &bench_object::get);
+    }
+
+    static const std::string class_name() {
+        return "bench_object";
+    }
+
+    int get(int a) {
+        return value + a;
+    }
+
+    int value = 1;
+};
+
+bench_object shared_object;
+
+bench_object * object() {
+    return &shared_object;
+}
+
+int raw_call0(lua_State *) {
+    return 0;
+}
+
+int raw_call1(lua_State *vm) {
+    lua_pushinteger(vm, lua_tointeger(vm, 1));
+    return 1;
+}
+
+int raw_call2(lua_State *vm) {
+    lua_pushinteger(vm, lua_tointeger(vm, 1) + lua_tointeger(vm, 2));
+    return 1;
+}
+
+int raw_call3(lua_State *vm) {
+    lua_pushinteger(vm, lua_tointeger(vm, 1) + lua_tointeger(vm, 2)
+        + lua_tointeger(vm, 3));
+    return 1;
+}
+
+int raw_number(lua_State *vm) {
+    lua_pushnumber(vm, lua_tonumber(vm, 1) * 0.5);
+    return 1;
+}
+
+int raw_echo(lua_State *vm) {
+    size_t length;
+    auto s = lua_tolstring(vm, 1, &length);
+    lua_pushlstring(vm, s, length);
+    return 1;
+}
+
+int raw_get(lua_State *vm) {
+    auto o = *(bench_object **)lua_touserdata(vm, 1);
+    lua_pushinteger(vm, o->get(lua_tointeger(vm, 2)));
+    return 1;
+}
+
+int raw_collect(lua_State *vm) {
+    delete *(bench_object **)lua_touserdata(vm, 1);
+    return 0;
+}
+
+void raw_wrap(lua_State *vm, bench_object *o, const char *metatable) {
+    *(bench_object **)lua_newuserdata(vm, sizeof(bench_object *)) = o;
+    luaL_getmetatable(vm, metatable);
+    lua_setmetatable(vm, -2);
+}
+
+int raw_new(lua_State *vm) {
+    raw_wrap(vm, new bench_object(), "raw_owned");
+    return 1;
+}
+
+int raw_object(lua_State *vm) {
+    raw_wrap(vm, &shared_object, "raw_object");
+    return 1;
+}
+
+/* Lua::serialize into a reused buffer; the pure Lua encoder is the baseline. */
+int snapshot(lua_State *state) {
+    static char buffer[4096];
+    util::Lua vm(state);
+    lua_pushinteger(state, vm.serialize(1, buffer, sizeof(buffer)));
+    return 1;
+}
+
+void raw_setup(lua_State *vm) {
+    lua_newtable(vm);
+    lua_pushcfunction(vm, raw_get);
+    lua_setfield(vm, -2, "get");
+    luaL_newmetatable(vm, "raw_object");
+    lua_pushvalue(vm, -2);
+    lua_setfield(vm, -2, "__index");
+    lua_pop(vm, 1);
+    luaL_newmetatable(vm, "raw_owned");
+    lua_pushvalue(vm, -2);
+    lua_setfield(vm, -2, "__index");
+    lua_pushcfunction(vm, raw_collect);
+    lua_setfield(vm, -2, "__gc");
+    lua_pop(vm, 2);
+
+    lua_newtable(vm);
+    lua_pushcfunction(vm, raw_new);
+    lua_setfield(vm, -2, "new");
+    lua_setglobal(vm, "raw_class");
+
+    static const struct {
+        const char *name;
+        lua_CFunction function;
+    } functions[] = {
+        { "raw_call0", raw_call0 },
+        { "raw_call1", raw_call1 },
+        { "raw_call2", raw_call2 },
+        { "raw_call3", raw_call3 },
+        { "raw_number", raw_number },
+        { "raw_echo", raw_echo },
+        { "raw_object", raw_object },
+        { "snapshot", snapshot },
+    };
+    for (auto& f : functions) {
+        lua_pushcfunction(vm, f.function);
+        lua_setglobal(vm, f.name);
+    }
+}
+
+void setup(util::Lua& vm) {
+    vm.export_function("call0", &call0);
+    vm.export_function("call1", &call1);
+    vm.export_function("call2", &call2);
+    vm.export_function("call3", &call3);
+    vm.export_function("number", &number);
+    vm.export_function("echo", &echo);
+    vm.export_function("object", &object);
+    bench_object::export_me(vm);
+    raw_setup(vm.state());
+
+    static const char prelude[] =
+        "bound = bench_object.new()\n"
+        "raw = raw_class.new()\n"
+        "text = string.rep('x', 32)\n"
+        "record = { id = 42, name = 'sample', tags = {'a', 'b', 'c'},\n"
+        "    values = {1.5, 2.5, 3.5, 4.5}, nested = { ok = true } }\n"
+        "local function encode(v, out)\n"
+        "    local t = type(v)\n"
+        "    if t == 'table' then\n"
+        "        out[#out + 1] = '{'\n"
+        "        for k, x in pairs(v) do\n"
+        "            encode(k, out) out[#out + 1] = '=' encode(x, out)\n"
+        "            out[#out + 1] = ','\n"
+        "        end\n"
+        "        out[#out + 1] = '}'\n"
+        "    elseif t == 'string' then\n"
+        "        out[#out + 1] = string.format('%q', v)\n"
+        "    else\n"
+        "        out[#out + 1] = tostring(v)\n"
+        "    end\n"
+        "end\n"
+        "function lua_snapshot(v)\n"
+        "    local out = {}\n"
+        "    encode(v, out)\n"
+        "    return table.concat(out)\n"
+        "end\n";
+    vm.buffer(prelude, sizeof(prelude) - 1, "=prelude");
+}
+
+struct Case {
+    const char *name;
+    const char *body;
+    const char *baseline;
+};
+
+const Case cases[] = {
+    { "call0", "call0()", "raw_call0()" },
+    { "call1", "call1(i)", "raw_call1(i)" },
+    { "call2", "call2(i, i)", "raw_call2(i, i)" },
+    { "call3", "call3(i, i, i)", "raw_call3(i, i, i)" },
+    { "method", "bound:get(i)", "raw:get(i)" },
+    { "constructor", "bench_object.new()", "raw_class.new()" },
+    { "object", "object()", "raw_object()" },
+    { "number", "number(i)", "raw_number(i)" },
+    { "string", "echo(text)", "raw_echo(text)" },
+    { "serialize", "snapshot(record)", "lua_snapshot(record)" },
+};
+
+/* Nanoseconds per iteration of a loop running statement. */
+double measure(util::Lua& vm, const std::string& statement,
+    const long iterations) {
+    auto script = "for i = 1, " + std::to_string(iterations) + " do "
+        + statement + " end";
+    auto started = std::chrono::steady_clock::now();
+    vm.buffer(script.data(), script.size(), "=bench");
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - started;
+    return elapsed.count() / iterations;
+}
+
+/* Script load: Lua::buffer against luaL_loadbuffer + lua_pcall. */
+double measure_load(util::Lua& vm, const bool raw, const long iterations) {
+    static const char chunk[] = "local a = 1 return a + 1";
+    auto state = vm.state();
+    auto started = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) {
+        if (raw) {
+            luaL_loadbuffer(state, chunk, sizeof(chunk) - 1, "=load");
+            lua_pcall(state, 0, 0, 0);
+        } else {
+            vm.buffer(chunk, sizeof(chunk) - 1, "=load");
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - started;
+    return elapsed.count() / iterations;
+}
+
+void report(const char *name, const double bound, const double raw,
+    const bool last) {
+    std::cout << "    {\"name\": \"" << name << "\", \"ns_per_op\": " << bound
+        << ", \"baseline_ns_per_op\": " << raw << ", \"ratio\": "
+        << (raw > 0 ? bound / raw : 0) << "}" << (last ? "" : ",")
+        << std::endl;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? std::atol(argv[1]) : 1000000;
+    if (iterations <= 0)
+        iterations = 1000000;
+
+    util::Lua vm;
+    setup(vm);
+
+    std::cout << "{" << std::endl
+        << "  \"lua\": \"" << LUA_RELEASE << "\"," << std::endl
+        << "  \"iterations\": " << iterations << "," << std::endl
+        << "  \"results\": [" << std::endl;
+
+    for (auto& c : cases) {
+        // Warm up both paths (and the JIT, if any) before timing.
+        measure(vm, c.body, iterations / 10 + 1);
+        measure(vm, c.baseline, iterations / 10 + 1);
+        double bound = measure(vm, c.body, iterations);
+        double raw = measure(vm, c.baseline, iterations);
+        report(c.name, bound, raw, false);
+    }
+
+    long loads = iterations / 10 + 1;
+    double bound = measure_load(vm, false, loads);
+    double raw = measure_load(vm, true, loads);
+    report("load", bound, raw, true);
+
+    std::cout << "  ]" << std::endl << "}" << std::endl;
+    return 0;
+}
@@ -1,5 +1,12 @@
-find_path(LUA_INCLUDE_DIR lua.h)
-find_library(LUA_LIBRARY NAMES lua)
+if (LUA_USE_LUAJIT)
+    find_path(LUA_INCLUDE_DIR luajit.h PATH_SUFFIXES luajit-2.1 luajit-2.0)
+    find_library(LUA_LIBRARY NAMES luajit-5.1 luajit)
+endif (LUA_USE_LUAJIT)
+
+find_path(LUA_INCLUDE_DIR lua.h
+    PATH_SUFFIXES lua5.4 lua54 lua5.3 lua53 lua5.2 lua52 lua5.1 lua51 lua)
+find_library(LUA_LIBRARY
+    NAMES lua lua5.4 lua54 lua5.3 lua53 lua5.2 lua52 lua5.1 lua51)
 
 if (LUA_INCLUDE_DIR AND LUA_LIBRARY)
     set(LUA_FOUND TRUE)
@@ -1,6 +1,22 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <Lua.hh>
+#include <LuaAllocator.hh>
+#include <LuaStatePool.hh>
+#include <LuaExecutor.hh>
+#include <LuaArray.hh>
+#include <LuaProfiler.hh>
+#ifdef __linux__
+#include <LuaLoop.hh>
+#include <thread>
+#endif
 
 void test() {
     std::cout << "Hello, world! " << std::endl;
@@ -18,6 +34,96 @@ int test3(int a) {
     return a + 1;
 }
 
+int test4(int a, int b) {
+    return a * b;
+}
+
+int64_t test7(int64_t a) {
+    return a + 1;
+}
+
+double test8(double a, double b) {
+    return a * b;
+}
+
+std::string test5(const char *a, const std::string& b) {
+    return std::string(a) + b + std::string("\0!", 2);
+}
+
+#if __cplusplus >= 201703L
+int test6(std::string_view a) {
+    return a.size();
+}
+#endif
+
+#ifdef __linux__
+util::LuaLoop loop;
+
+util::LuaFuture<int> delayed(int a) {
+    util::LuaFuture<int> result;
+    std::thread([result, a] () mutable {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (a < 0)
+            result.set_error("negative");
+        else
+            result.set_value(a * 2);
+    }).detach();
+    return result;
+}
+
+util::LuaFuture<std::string> echoed(std::string text) {
+    util::LuaFuture<std::string> result;
+    std::thread([result, text] () mutable {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        result.set_value(text);
+    }).detach();
+    return result;
+}
+#endif
+
+std::map<std::string, int> test9(const std::vector<std::string>& words) {
+    std::map<std::string, int> counts;
+    for (auto& word : words)
+        counts[word]++;
+    return counts;
+}
+
+std::vector<std::vector<int>> test10(int rows, int columns) {
+    return std::vector<std::vector<int>>(rows, std::vector<int>(columns, 1));
+}
+
+double test11(const std::array<double, 3>& v,
+    const std::unordered_map<int, double>& weights) {
+    double sum = 0;
+    for (auto& weight : weights)
+        sum += v[weight.first] * weight.second;
+    return sum;
+}
+
+util::LuaArray<double> test12(util::LuaArray<double> a) {
+    for (size_t i = 0; i < a.size(); i++)
+        a[i] += 1;
+    return a;
+}
+
+std::tuple<bool, int, std::string> test13(int a, int b) {
+    if (!b)
+        return std::make_tuple(false, 0, "division by zero");
+    return std::make_tuple(true, a / b, "");
+}
+
+uint8_t test15(int16_t a) {
+    return a * 2;
+}
+
+util::LuaArray<double> test16(util::LuaArray<double> a) {
+    return util::LuaArray<double>(a.data(), a.size() / 2);
+}
+
+std::pair<int, int> test14(int a, int b) {
+    return std::make_pair(a / b, a % b);
+}
+
 class test_class : public util::LuaClass {
 public:
     static void export_me(util::Lua& vm) {
@@ -30,6 +136,27 @@ public:
         vm.export_method("test1", &test_class::test1);
         vm.export_method("test2", &test_class::test2);
         vm.export_method("test3", &test_class::test3);
+        vm.export_method("self", &test_class::self);
+        vm.export_field("counter", &test_class::counter);
+        vm.export_readonly("serial", &test_class::serial);
+        vm.export_property("label", &test_class::get_label,
+            &test_class::set_label);
+    }
+
+    int counter = 0;
+    const int serial = 42;
+    std::string text;
+
+    test_class * self() {
+        return this;
+    }
+
+    std::string get_label() const {
+        return "<" + text + ">";
+    }
+
+    void set_label(const std::string& label) {
+        text = label;
     }
 
     static const std::string class_name() {
@@ -53,6 +180,81 @@ public:
     }
 };
 
+class test_child : public test_class {
+public:
+    static void export_me(util::Lua& vm) {
+        vm.export_class<test_child, test_class>();
+    }
+
+    static void export_class(util::Lua& vm) {
+        vm.export_constructor<test_child>();
+        vm.export_method("test4", &test_child::test4);
+    }
+
+    static const std::string class_name() {
+        return "test_child";
+    }
+
+    int test4() {
+        return 4;
+    }
+};
+
+class test_leaf : public test_child {
+public:
+    static void export_me(util::Lua& vm) {
+        vm.export_class<test_leaf, test_child, util::Lua::Flattened>();
+    }
+
+    static void export_class(util::Lua& vm) {
+        vm.export_constructor<test_leaf>();
+        vm.export_method("test1", &test_leaf::test1);
+    }
+
+    static const std::string class_name() {
+        return "test_leaf";
+    }
+
+    int test1() {
+        return 10;
+    }
+};
+
+class test_model : public util::LuaClass {
+public:
+    static int alive;
+
+    static void export_me(util::Lua& vm) {
+        vm.export_class<test_model>();
+    }
+
+    static void export_class(util::Lua& vm) {
+        vm.export_method("weight", &test_model::weight);
+    }
+
+    static const std::string class_name() {
+        return "test_model";
+    }
+
+    test_model() {
+        alive++;
+    }
+
+    ~test_model() {
+        alive--;
+    }
+
+    double weight(double x) {
+        return x * 0.25;
+    }
+};
+
+int test_model::alive = 0;
+
+double weigh(std::shared_ptr<test_model> model, double x) {
+    return model->weight(x);
+}
+
 int main(int argc, char *argv[]) {
     util::Lua l;
 
@@ -60,10 +262,341 @@ int main(int argc, char *argv[]) {
     l.export_function("test1", &test1);
     l.export_function("test2", &test2);
     l.export_function("test3", &test3);
+    l.export_function("test4", &test4);
+    l.export_function("test5", &test5);
+    l.export_function("test7", &test7);
+    l.export_ffi_function("test8", &test8);
+    l.export_ffi_function("test7ffi", &test7);
+    l.export_function("test9", &test9);
+    l.export_function("test10", &test10);
+    l.export_function("test11", &test11);
+    l.export_function("test12", &test12);
+    l.export_function("test13", &test13);
+    l.export_function("test14", &test14);
+    l.export_function("test15", &test15);
+    l.export_function("test16", &test16);
+    util::LuaArray<double>::export_me(l, "DoubleArray");
+    util::LuaArray<int32_t>::export_me(l, "IntArray");
+    util::LuaArray<int64_t>::export_me(l, "LongArray");
+    std::vector<double> samples(1000, 0.5);
+    util::LuaArray<double>::push(l, samples);
+    l.save("samples");
+#if __cplusplus >= 201703L
+    l.export_function("test6", &test6);
+#endif
 
     test_class::export_me(l);
+    test_child::export_me(l);
+    test_leaf::export_me(l);
+
+    static const char prelude[] = "prelude = 'Hello, buffer!'";
+    l.buffer(prelude, sizeof(prelude) - 1, "=prelude");
+
+    auto greeting = l.intern("greeting");
+    l.string("Hello, interned world!");
+    l.save(greeting);
+
+    if (argc > 1) {
+        util::LuaChunkCache cache(argv[1]);
+        l.file("test.lua", cache);
+        std::cout << "chunk cache: " << cache.hits() << " hits, "
+            << cache.misses() << " misses" << std::endl;
+
+        // A second load is a hit; editing or touching the source misses.
+        util::LuaChunkCache check(argv[1]);
+        std::string script = std::string(argv[1]) + "/cached.lua";
+        std::ofstream(script) << "cached = 1\n";
+        l.file(script, check);
+        l.file(script, check);
+        if (check.hits() != 1 || check.misses() != 1)
+            return 1;
+        std::ofstream(script) << "cached = 2\n";
+        l.file(script, check);
+        l.global("cached");
+        if (check.misses() != 2 || l.tointeger() != 2)
+            return 1;
+        l.pop();
+        struct timespec times[2] = { { 0, UTIME_OMIT }, { 1000000000, 0 } };
+        utimensat(AT_FDCWD, script.c_str(), times, 0);
+        l.file(script, check);
+        if (check.hits() != 1 || check.misses() != 3)
+            return 1;
+    } else {
+        l.file("test.lua");
+    }
 
-    l.file("test.lua");
+    util::Lua::instrument(true);
+    static const char instrumented[] =
+        "for i = 1, 100 do test4(i, 2) end\n"
+        "local o = test_class.new()\n"
+        "for i = 1, 10 do o:test1() end\n";
+    l.buffer(instrumented, sizeof(instrumented) - 1, "=instrumented");
+    util::Lua::instrument(false);
+    l.buffer(instrumented, sizeof(instrumented) - 1, "=instrumented");
+    unsigned long recorded = 0;
+    for (auto& binding : l.stats(true)) {
+        if ((binding.name == "test4" && binding.calls == 100)
+            || (binding.name == "test_class.test1" && binding.calls == 10))
+            recorded++;
+        std::cout << "stats: " << binding.name << " " << binding.calls
+            << " calls, " << binding.total_ns << "ns" << std::endl;
+    }
+    if (recorded != 2 || !l.stats().empty())
+        return 1;
+
+    static const char profiled[] =
+        "local function inner(n)\n"
+        "    local s = 0\n"
+        "    for i = 1, n do s = s + test4(i, 1) end\n"
+        "    return s\n"
+        "end\n"
+        "local function outer()\n"
+        "    for i = 1, 200 do inner(100) end\n"
+        "end\n"
+        "outer()\n";
+    for (auto trigger : { util::LuaProfiler::Count, util::LuaProfiler::Timer }) {
+        util::LuaProfiler profiler(trigger,
+            trigger == util::LuaProfiler::Count ? 1000 : 100);
+        profiler.start(l);
+        // Timer samples depend on wall time: run until there are enough.
+        for (int i = 0; i < 100 && (!i || (trigger == util::LuaProfiler::Timer
+            && profiler.samples() < 50)); i++)
+            l.buffer(profiled, sizeof(profiled) - 1, "=profiled");
+        profiler.stop();
+        std::ostringstream folded;
+        profiler.folded(folded);
+        auto stacks = folded.str();
+#ifdef LUA_USE_LUAJIT
+        // Count mode is unsupported on LuaJIT and bindings are not named;
+        // inner may be compiled into outer's trace and lose its frame.
+        if (trigger == util::LuaProfiler::Timer
+            && stacks.find("outer profiled:6") == std::string::npos)
+            return 1;
+#else
+        bool lua = stacks.find("outer profiled:6;inner profiled:1")
+            != std::string::npos;
+        bool bound = stacks.find("inner profiled:1;test4 [C]")
+            != std::string::npos;
+        if (!lua || (trigger == util::LuaProfiler::Timer && !bound))
+            return 1;
+#endif
+        std::cout << "profiler: " << profiler.samples() << " samples"
+            << std::endl;
+    }
+
+#ifndef LUA_USE_LUAJIT
+    {
+        // Deep stacks keep their roots: inner's samples fold into outer.
+        util::LuaProfiler profiler(util::LuaProfiler::Count, 1000, 2);
+        profiler.start(l);
+        l.buffer(profiled, sizeof(profiled) - 1, "=profiled");
+        profiler.stop();
+        std::ostringstream folded;
+        profiler.folded(folded);
+        auto stacks = folded.str();
+        if (stacks.find("main profiled;outer profiled:6;... ")
+            == std::string::npos || stacks.find("inner") != std::string::npos)
+            return 1;
+    }
+#endif
+
+    auto objects = l.object_cache();
+    if (!objects.hits)
+        return 1;
+    std::cout << "object cache: " << objects.hits << " hits, "
+        << objects.misses << " misses" << std::endl;
+
+    util::LuaFunction<std::string(const std::string&, int)> hook(l, "hook");
+    for (int i = 0; i < 1000; i++)
+        if (hook("event", i) != "event" + std::to_string(i))
+            return 1;
+    auto copied = hook;
+    std::cout << copied("hook: ", 1000) << std::endl;
+
+    util::LuaFunction<double(double)> score(l, "score");
+    std::vector<std::tuple<double>> inputs;
+    for (int i = 0; i < 10000; i++)
+        inputs.push_back(std::make_tuple(i == 500 ? -1.0 : double(i)));
+    std::vector<double> scores(inputs.size());
+    auto started = std::chrono::steady_clock::now();
+    auto errors = l.batch(score, inputs.data(), inputs.size(), scores.data());
+    auto batched = std::chrono::steady_clock::now() - started;
+    if (errors.size() != 1 || errors[0].index != 500 || scores[7] != 49)
+        return 1;
+    started = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < inputs.size(); i++)
+        try {
+            scores[i] = score(std::get<0>(inputs[i]));
+        } catch (const std::runtime_error&) {
+        }
+    auto single = std::chrono::steady_clock::now() - started;
+    std::cout << "batch: " << errors[0].message << ", "
+        << std::chrono::duration_cast<std::chrono::microseconds>(batched).count()
+        << "us batched, "
+        << std::chrono::duration_cast<std::chrono::microseconds>(single).count()
+        << "us single" << std::endl;
+
+    util::LuaAllocator allocator(256 * 1024);
+    {
+        util::Lua limited(allocator);
+        static const char script[] =
+            "local t = {}\n"
+            "for i = 1, 1000 do t[i] = tostring(i) end\n"
+            "assert(not pcall(string.rep, 'x', 1024 * 1024))\n";
+        limited.buffer(script, sizeof(script) - 1, "=allocator");
+    }
+    auto statistics = allocator.statistics();
+    std::cout << "allocator: " << statistics.live << " live, "
+        << statistics.peak << " peak, " << statistics.allocations
+        << " allocations" << std::endl;
+
+    util::LuaStatePool pool(2, 4, 2);
+    pool.export_function("test4", &test4);
+    pool.record([] (util::Lua& vm) {
+        static const char script[] = "function area(w, h) return test4(w, h) end";
+        vm.buffer(script, sizeof(script) - 1, "=pool");
+    });
+    pool.warm();
+    for (int i = 0; i < 3; i++) {
+        auto lease = pool.acquire();
+        static const char script[] =
+            "assert(area(6, 7) == 42 and tenant == nil)\n"
+            "tenant = true\n"
+            "area = nil\n";
+        lease->buffer(script, sizeof(script) - 1, "=lease");
+    }
+    auto metrics = pool.metrics();
+    std::cout << "pool: " << metrics.acquisitions << " acquisitions, "
+        << metrics.created << " created, " << metrics.recycled
+        << " recycled" << std::endl;
+
+    util::LuaExecutor executor([] (util::Lua& vm) {
+        vm.export_function("test4", &test4);
+        static const char script[] =
+            "function area(w, h) return test4(w, h) end\n"
+            "function fail() error('failed') end\n";
+        vm.buffer(script, sizeof(script) - 1, "=executor");
+    }, 4);
+    std::vector<std::future<int>> areas;
+    for (int i = 0; i < 64; i++)
+        areas.push_back(executor.call<int>("area", i, 2));
+    for (int i = 0; i < 64; i++)
+        if (areas[i].get() != i * 2)
+            return 1;
+    auto failed = executor.call<void>("fail");
+    try {
+        failed.get();
+        return 1;
+    } catch (const std::runtime_error& error) {
+        std::cout << "executor: " << error.what() << std::endl;
+    }
+    if (l.call<int>("test4", 3, 5) != 15)
+        return 1;
+
+    {
+        static const char snapshot[] =
+            "return { 1, 2.5, 'x', true, name = 'x', [10] = false,\n"
+            "    nested = { { 'x' }, { 'y', -7 } }, [2.5] = 'x' }\n";
+        l.buffer(snapshot, sizeof(snapshot) - 1, "=snapshot");
+        std::string encoded = l.serialize();
+        char small[8];
+        if (l.serialize(-1, small, sizeof(small)) != encoded.size())
+            return 1;
+        l.pop();
+        util::Lua copy;
+        copy.deserialize(encoded.data(), encoded.size());
+        copy.save("snapshot");
+        static const char check[] =
+            "assert(snapshot[1] == 1 and snapshot[2] == 2.5)\n"
+            "assert(snapshot[3] == 'x' and snapshot[4] == true)\n"
+            "assert(snapshot.name == 'x' and snapshot[10] == false)\n"
+            "assert(snapshot[2.5] == 'x' and snapshot.nested[2][2] == -7)\n";
+        copy.buffer(check, sizeof(check) - 1, "=snapshot");
+        try {
+            copy.deserialize(encoded.data(), encoded.size() - 1);
+            return 1;
+        } catch (const std::runtime_error&) {
+        }
+        std::cout << "serialize: " << encoded.size() << " bytes" << std::endl;
+    }
+
+#ifdef __linux__
+    loop.export_function(l, "delayed", &delayed);
+    loop.export_function(l, "echoed", &echoed);
+    static const char tasks[] =
+        "function sum(n)\n"
+        "    local total = 0\n"
+        "    for i = 1, n do total = total + delayed(i) end\n"
+        "    assert(delayed(-1) == nil)\n"
+        "    local text = string.rep('echo', 16)\n"
+        "    assert(echoed(text) == text)\n"
+        "    return total\n"
+        "end\n";
+    l.buffer(tasks, sizeof(tasks) - 1, "=loop");
+    std::vector<util::LuaFuture<int>> sums;
+    for (int i = 0; i < 100; i++)
+        sums.push_back(loop.spawn<int>(l, "sum", 3));
+    loop.run();
+    for (auto& sum : sums)
+        if (sum.value() != 12)
+            return 1;
+    std::cout << "loop: " << sums.size() << " tasks" << std::endl;
+#endif
+
+    if (samples[0] != 3.0 || samples[999] != 3.0)
+        return 1;
+
+    {
+        auto model = std::make_shared<test_model>();
+        util::LuaExecutor shared([model] (util::Lua& vm) {
+            test_model::export_me(vm);
+            vm.object(model);
+            vm.save("model");
+            static const char script[] =
+                "function score(x) return model:weight(x) end";
+            vm.buffer(script, sizeof(script) - 1, "=shared");
+        }, 4);
+        model.reset();
+        std::vector<std::future<double>> scores;
+        for (int i = 0; i < 32; i++)
+            scores.push_back(shared.call<double>("score", i));
+        for (int i = 0; i < 32; i++)
+            if (scores[i].get() != i * 0.25)
+                return 1;
+        if (test_model::alive != 1)
+            return 1;
+    }
+    if (test_model::alive != 0)
+        return 1;
+    std::cout << "shared: released" << std::endl;
+
+    {
+        // A raw wrapper of a shared object must not stand in for its owner.
+        util::Lua vm;
+        test_model::export_me(vm);
+        util::LuaArray<double>::export_me(vm, "DoubleArray");
+        vm.export_function("weigh", &weigh);
+        auto model = std::make_shared<test_model>();
+        vm.object(model.get(), "test_model");
+        vm.save("raw");
+        vm.object(model);
+        vm.save("kept");
+        static const char script[] =
+            "assert(not rawequal(raw, kept))\n"
+            "assert(weigh(raw, 4) == 1 and weigh(kept, 4) == 1)\n"
+            "assert(not pcall(weigh, DoubleArray.new(1), 4))\n"
+            "raw = nil\n"
+            "collectgarbage()\n"
+            "collectgarbage()\n";
+        vm.buffer(script, sizeof(script) - 1, "=mixed");
+        model.reset();
+        if (test_model::alive != 1)
+            return 1;
+        static const char check[] = "assert(kept:weight(4) == 1)";
+        vm.buffer(check, sizeof(check) - 1, "=mixed");
+    }
+    if (test_model::alive != 0)
+        return 1;
 
     return 0;
 }
@@ -1,12 +1,34 @@
 
 test()
 
+print(greeting)
+print(prelude)
+
 test1(1)
 
 print(test2())
 
 print(test3(3))
 
+print(test4(2, 3))
+
+assert(test5("a", "b") == "ab\0!")
+if math.type then
+    assert(test7(9007199254740993) == 9007199254740994)
+end
+print(test7(41))
+assert(type(test7ffi(41)) == "number" and test7ffi(41) == 42)
+
+local product = 0
+for i = 1, 1000 do
+    product = product + test8(i, 0.5)
+end
+print(type(test8), product)
+
+if test6 then
+    print(test6(test5("a", "b")))
+end
+
 t = test_class.new()
 print(t)
 t:test()
@@ -14,3 +36,85 @@ print(t:test1())
 print(t:test2(2))
 t:test3(3)
 
+
+c = test_child.new()
+print(c)
+c:test()
+print(c:test2(3))
+print(c:test4())
+print(c == c, c == t)
+c = nil
+collectgarbage()
+
+function hook(name, n)
+    return name .. n
+end
+
+function score(x)
+    if x < 0 then
+        error("negative score input")
+    end
+    return x * x
+end
+
+local counts = test9({"a", "b", "a"})
+assert(counts.a == 2 and counts.b == 1)
+local grid = test10(3, 4)
+assert(#grid == 3 and #grid[3] == 4 and grid[2][2] == 1)
+assert(test11({1, 2, 3}, {[0] = 1, [2] = 0.5}) == 2.5)
+local ok, q, err = test13(7, 2)
+assert(ok and q == 3 and err == "")
+ok, q, err = test13(7, 0)
+assert(not ok and err == "division by zero")
+assert(select("#", test14(7, 2)) == 2 and select(2, test14(7, 2)) == 1)
+assert(test15(200) == 144 and test15(-1) == 254)
+assert(not pcall(test15, 40000))
+
+local a = DoubleArray.new(8)
+local b = DoubleArray.new(8)
+assert(#a == 8 and a[1] == 0 and a[9] == nil)
+for i = 1, #a do a[i] = i end
+b:fill(2)
+assert(a:sum() == 36 and a:min() == 1 and a:max() == 8)
+assert(a:dot(b) == 72)
+a:axpy(0.5, b):mul(b)
+assert(a[1] == 4 and a[8] == 18)
+assert(not pcall(a.add, a, DoubleArray.new(3)))
+assert(test12(b)[1] == 3 and b[1] == 3)
+local v = test12(DoubleArray.new(1000))
+local head = test16(DoubleArray.new(1000):fill(2))
+collectgarbage()
+collectgarbage()
+assert(v[1] == 1 and #head == 500 and head[500] == 2)
+assert(rawequal(test12(b), b))
+assert(not pcall(DoubleArray.new, 2^61) and not pcall(IntArray.new, 2^70))
+local n = IntArray.new(5):fill(3)
+local long = LongArray.new(1)
+long[1] = 9007199254740993
+assert(long[1] == 9007199254740993)
+assert(n:sum() == 15)
+assert(samples:sum() == 500)
+samples:scale(6)
+
+local object = test_class.new()
+object.counter = object.counter + 5
+object.label = "tag"
+assert(object.counter == 5 and object.serial == 42 and object.label == "<tag>")
+assert(not pcall(function() object.serial = 1 end))
+assert(not pcall(function() object.missing = 1 end))
+assert(object.test1 and object:test1() == 1)
+local child = test_child.new()
+child.counter = 7
+assert(child.counter == 7 and child:test4() == 4 and child:test1() == 1)
+assert(not pcall(object.test1, DoubleArray.new(2)))
+assert(not pcall(object.test1, io.stdout) and not pcall(child.test4, object))
+
+local leaf = test_leaf.new()
+assert(rawget(test_leaf, "test2") and rawget(test_leaf, "test4"))
+assert(rawget(test_leaf, "mtab") ~= rawget(test_child, "mtab"))
+assert(leaf:test1() == 10 and leaf:test2(3) == 6 and leaf:test4() == 4)
+leaf.counter = 3
+assert(leaf.counter == 3)
+
+local same = test_class.new()
+assert(rawequal(same:self(), same) and rawequal(same:self():self(), same))